@@ -3,7 +3,8 @@
 // =========================
 #include <Arduino.h>
 #include <WiFi.h>
-#include <WebServer.h>
+#include <ESPAsyncWebServer.h>
+#include "web_assets.h" // Dihasilkan dari web/ oleh tools/embed_web_assets.py
 #include <EEPROM.h>
 #include <DNSServer.h>
 #include <HTTPClient.h>
@@ -16,6 +17,12 @@
 #include <Adafruit_GFX.h>
 #include <Adafruit_SSD1306.h>
 #include <Wire.h>
+#include <LittleFS.h>
+#include <atomic>
+#include <type_traits>
+#include <time.h>
+#include <esp_sntp.h>
+#include <esp_timer.h>
 
 // =========================
 // ======= KONFIGURASI =======
@@ -26,21 +33,76 @@
 #define LED_GREEN 4
 #define LED_RED 2
 #define LED_YELLOW 15
+#define FEEDBACK_TICK_MS 10 // Resolusi timer pola LED & buzzer
 
 // Konfigurasi OLED
 #define SCREEN_WIDTH 128
 #define SCREEN_HEIGHT 64
 #define OLED_RESET -1
 #define SCREEN_ADDRESS 0x3C
+#define OLED_PAGES (SCREEN_HEIGHT / 8) // Satu page = 8 baris piksel = SCREEN_WIDTH byte
+#define OLED_I2C_CLOCK 400000          // Clock I2C saat mengirim frame
+#define OLED_I2C_CHUNK 64              // Byte per transaksi I2C (buffer Wire ESP32 128 byte)
+#define OLED_RATE_WINDOW 10000         // Jendela hitung byte/detik ke panel (ms)
 
 // RFID Pin Configuration
 #define RST_PIN 33
 #define SS_PIN 5
 
 // Buffer Configuration
-#define MAX_BUFFER_SIZE 10 // Maksimum data yang bisa disimpan di buffer
 #define READ_TIMEOUT 25    // Timeout untuk pembacaan dalam ms
 
+// RFID Task Configuration
+#define RFID_TASK_CORE 0       // Core untuk task RFID (loop() berjalan di core 1)
+#define RFID_TASK_PRIORITY 2
+#define RFID_TASK_STACK 6144
+#define SCAN_QUEUE_SIZE 32     // Slot antrian scan antar-core (harus pangkat dua)
+#define LOOP_IDLE_WAIT_MS 15   // loop() tidur selama ini kecuali dibangunkan task RFID
+
+// Konfigurasi Task Upload
+#define UPLOAD_TASK_CORE 1        // Sama dengan loop(), WiFi stack di core 0 bersama RFID
+#define UPLOAD_TASK_PRIORITY 1
+#define UPLOAD_TASK_STACK 12288   // TLS handshake butuh stack besar
+#define UPLOAD_QUEUE_DEPTH 2      // Batch tersegel yang boleh menunggu giliran kirim
+
+// Konfigurasi Task Display
+#define DISPLAY_TASK_CORE 1
+#define DISPLAY_TASK_PRIORITY 1
+#define DISPLAY_TASK_STACK 4096
+#define DISPLAY_FRAME_INTERVAL 100 // Jarak minimum antar frame (ms), maks. 10 fps
+#define DISPLAY_TEXT_MAX 44        // Dua baris teks ukuran 1 (21 karakter) + NUL
+
+// Deteksi kartu: 1 = interrupt dari pin IRQ MFRC522, 0 = polling SPI (fallback)
+#ifndef RFID_USE_IRQ
+#define RFID_USE_IRQ 0
+#endif
+#define RFID_IRQ_PIN 27        // Pin IRQ MFRC522 (aktif-low)
+#define RFID_IRQ_REARM_MS 50   // Interval kirim ulang REQA saat menunggu kartu
+
+// Journal Configuration (antrian absensi di flash, tahan reboot & mati listrik)
+#define JOURNAL_DIR "/journal"
+#define JOURNAL_SEGMENT_SIZE 16384 // Ukuran maksimum satu file segmen (byte)
+#define JOURNAL_MAX_SEGMENTS 48    // Jumlah segmen aktif maksimum (~768 KB)
+#define JOURNAL_MAX_PAYLOAD 128    // Ukuran maksimum payload satu record
+
+// Clock Configuration (waktu scan dalam UTC)
+#define NTP_SERVER_1 "pool.ntp.org"
+#define NTP_SERVER_2 "time.google.com"
+#define CLOCK_BRIDGE_MAX_AGE 86400 // Jam dari RTC dipercaya maks. 1 hari setelah sinkron terakhir (detik)
+
+// UID Cache Configuration (identitas kartu yang sudah pernah dibaca)
+#define UID_CACHE_FILE "/uidcache.bin"
+#define UID_CACHE_CAPACITY 512           // Jumlah slot hash table (harus pangkat dua)
+#define UID_CACHE_MAX_ENTRIES 384        // Batas isi (load factor 75%)
+#define UID_CACHE_REVALIDATE_EVERY 20    // Baca ulang isi kartu setiap N tap
+#define UID_CACHE_FLUSH_INTERVAL 30000   // Simpan perubahan ke flash setiap 30 detik
+
+// Konfigurasi Diagnostik
+#define HEAP_REPORT_INTERVAL 60000 // Laporan heap ke Serial setiap 60 detik
+#define BATCH_STREAM_WINDOW 8      // Record journal yang dibaca sekaligus saat streaming payload
+// BATCH_FORMAT_BENCHMARK (build flag, lihat platformio.ini): bandingkan ukuran
+// & waktu encode JSON/CSV, polos dan gzip, saat boot
+
 // Inisialisasi objek OLED
 Adafruit_SSD1306 display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_RESET);
 
@@ -57,7 +119,169 @@ enum ErrorType
 
 // Variabel global
 ErrorType currentError = NO_ERROR;
-bool isSending = false;
+volatile bool isSending = false;
+
+// Bus I2C OLED dipakai displayTask() (dan loop() sebelum task berjalan) serta
+// reset RFID yang berbagi pin SDA, jadi setiap gambar harus memegang mutex
+// ini. Recursive karena fungsi OLED saling memanggil.
+SemaphoreHandle_t displayMutex = nullptr;
+
+struct DisplayLock
+{
+    DisplayLock() { if (displayMutex) xSemaphoreTakeRecursive(displayMutex, portMAX_DELAY); }
+    ~DisplayLock() { if (displayMutex) xSemaphoreGiveRecursive(displayMutex); }
+};
+
+// Semua gambar tetap ditulis ke buffer RAM Adafruit; flushOLED() membandingkan
+// buffer itu dengan salinan frame terakhir yang sudah ada di panel dan hanya
+// mengirim rentang kolom yang berubah per page. Frame identik tidak dikirim.
+struct OLEDRenderer
+{
+    uint8_t shadow[SCREEN_WIDTH * OLED_PAGES]; // Isi GDDRAM panel menurut flush terakhir
+    bool shadowValid;        // false = kirim frame penuh pada flush berikutnya
+    uint32_t frames;         // Jumlah panggilan flushOLED()
+    uint32_t skippedFrames;  // Frame identik, tanpa transfer I2C
+    uint32_t pagesSent;      // Page yang (sebagian) dikirim
+    uint32_t bytesSent;      // Byte di bus I2C: alamat, control byte, perintah & data
+    uint32_t i2cErrors;
+    uint32_t windowStart;
+    uint32_t windowBytes;
+    uint32_t bytesPerSecond; // Rata-rata selama OLED_RATE_WINDOW terakhir
+    OLEDRenderer() : shadowValid(false), frames(0), skippedFrames(0), pagesSent(0), bytesSent(0),
+                     i2cErrors(0), windowStart(0), windowBytes(0), bytesPerSecond(0) {}
+};
+OLEDRenderer oledRenderer; // Hanya disentuh dengan DisplayLock
+
+// Isi layar dikirim sebagai pesan bertipe ke displayTask(); pemanggil tidak
+// pernah menunggu bus I2C.
+enum DisplayKind : uint8_t
+{
+    DISPLAY_STATUS,     // Dua baris teks + jumlah scan tertunda
+    DISPLAY_IDLE,       // Tampilan default: jaringan & antrian
+    DISPLAY_ERROR,
+    DISPLAY_AP_INFO,    // SSID, password & IP access point
+    DISPLAY_CONNECTING, // Progress koneksi WiFi
+    DISPLAY_CONNECTED,  // SSID & IP setelah konfigurasi dari portal
+    DISPLAY_CLEAR
+};
+
+struct DisplayMessage
+{
+    DisplayKind kind;
+    uint8_t step;  // DISPLAY_CONNECTING: percobaan ke-step dari steps
+    uint8_t steps;
+    char primary[DISPLAY_TEXT_MAX];
+    char secondary[DISPLAY_TEXT_MAX];
+};
+
+// Mailbox satu slot: pesan baru menimpa pesan yang belum dirender, jadi
+// rentetan update digabung menjadi keadaan terakhir saja.
+struct DisplayQueue
+{
+    QueueHandle_t mailbox;
+    TaskHandle_t task;
+    uint32_t posted;
+    uint32_t merged;       // Pesan yang tertimpa sebelum sempat dirender
+    uint32_t rendered;
+    uint32_t lastRenderMs;
+    uint32_t maxRenderMs;
+    DisplayQueue() : mailbox(nullptr), task(nullptr), posted(0), merged(0), rendered(0),
+                     lastRenderMs(0), maxRenderMs(0) {}
+};
+DisplayQueue displayQueue;
+
+// LED & buzzer dimainkan timer esp_timer di background. Setiap output punya
+// satu voice; pola baru pada output yang sama digabung (cue identik) atau
+// menggantikan pola yang sedang jalan bila prioritasnya tidak lebih rendah.
+// Hanya engine ini yang menulis pin. Indikator status (updateLEDStatus)
+// cukup mengatur level dasar yang dipulihkan engine setelah setiap pola.
+enum FeedbackOutput : uint8_t
+{
+    FEEDBACK_GREEN,
+    FEEDBACK_RED,
+    FEEDBACK_YELLOW,
+    FEEDBACK_BUZZER,
+    FEEDBACK_OUTPUT_COUNT
+};
+const uint8_t FEEDBACK_PINS[FEEDBACK_OUTPUT_COUNT] = {LED_GREEN, LED_RED, LED_YELLOW, BUZZER_PIN};
+
+enum FeedbackPriority : uint8_t
+{
+    FEEDBACK_PRIORITY_LOW,    // Indikator progress yang berulang
+    FEEDBACK_PRIORITY_NORMAL, // blinkLED()/beep() biasa & sukses
+    FEEDBACK_PRIORITY_HIGH    // Error, tidak boleh tertutup pola lain
+};
+
+enum FeedbackKind : uint8_t
+{
+    FEEDBACK_SUCCESS,  // Scan berhasil
+    FEEDBACK_ERROR,    // Kartu tidak terbaca
+    FEEDBACK_WARNING,  // Blok gagal dibaca, coba tap lagi
+    FEEDBACK_PROGRESS, // Kedip kuning berulang sampai stopFeedback()
+    FEEDBACK_READING,  // Kedip kuning cepat selama blok kartu dibaca
+    FEEDBACK_KIND_COUNT,
+    FEEDBACK_ADHOC = 0xFF // Dari blinkLED()/beep()
+};
+
+// Satu cue: nyala onMs, mati offMs, sebanyak times kali pada satu output
+struct FeedbackCue
+{
+    FeedbackOutput output;
+    uint8_t times;
+    uint16_t onMs;
+    uint16_t offMs;
+};
+
+struct FeedbackPattern
+{
+    FeedbackPriority priority;
+    bool loop;
+    uint8_t cueCount;
+    FeedbackCue cues[2];
+};
+
+const FeedbackPattern FEEDBACK_PATTERNS[FEEDBACK_KIND_COUNT] = {
+    {FEEDBACK_PRIORITY_NORMAL, false, 2, {{FEEDBACK_GREEN, 1, 50, 50}, {FEEDBACK_BUZZER, 1, 100, 0}}},
+    {FEEDBACK_PRIORITY_HIGH, false, 2, {{FEEDBACK_RED, 2, 100, 100}, {FEEDBACK_BUZZER, 3, 100, 100}}},
+    {FEEDBACK_PRIORITY_HIGH, false, 2, {{FEEDBACK_RED, 2, 100, 100}, {FEEDBACK_BUZZER, 2, 200, 200}}},
+    {FEEDBACK_PRIORITY_LOW, true, 1, {{FEEDBACK_YELLOW, 1, 50, 50}}},
+    {FEEDBACK_PRIORITY_LOW, true, 1, {{FEEDBACK_YELLOW, 1, 30, 30}}},
+};
+
+struct FeedbackVoice
+{
+    FeedbackCue cue;
+    uint8_t remaining;      // Siklus nyala tersisa, 0 = idle
+    bool loop;
+    bool on;
+    bool level;             // Level pin saat ini
+    FeedbackPriority priority;
+    FeedbackKind kind;
+    unsigned long phaseEnd; // millis() saat fase nyala/mati berakhir
+};
+
+struct FeedbackEngine
+{
+    FeedbackVoice voices[FEEDBACK_OUTPUT_COUNT];
+    bool base[FEEDBACK_OUTPUT_COUNT]; // Level pin saat voice idle (indikator status)
+    esp_timer_handle_t timer;
+    uint32_t started;
+    uint32_t merged;    // Cue identik saat output sedang memainkannya
+    uint32_t preempted; // Pola yang dipotong pola lain
+    uint32_t dropped;   // Kalah prioritas dari pola yang sedang jalan
+    FeedbackEngine() : voices(), base(), timer(nullptr), started(0), merged(0), preempted(0), dropped(0) {}
+};
+FeedbackEngine feedback;
+portMUX_TYPE feedbackMux = portMUX_INITIALIZER_UNLOCKED; // Voice diubah dari banyak task & timer
+
+// Journal ditulis loop() dan di-commit task upload
+extern SemaphoreHandle_t journalMutex;
+
+struct JournalLock
+{
+    JournalLock() { if (journalMutex) xSemaphoreTakeRecursive(journalMutex, portMAX_DELAY); }
+    ~JournalLock() { if (journalMutex) xSemaphoreGiveRecursive(journalMutex); }
+};
 
 // =========================
 // ======= KONFIGURASI WIFI =======
@@ -74,16 +298,79 @@ String previousPassword = "";
 
 unsigned long lastWiFiCheck = 0;
 const unsigned long WIFI_CHECK_INTERVAL = 30000; // 30 detik
+unsigned long wifiOfflineSince = 0;              // millis() saat WiFi putus, 0 = online
+
+// Selama offline scan tetap masuk journal. Kredensial hanya tersimpan setelah
+// pernah berhasil terhubung, jadi defaultnya tidak pernah dihapus otomatis.
+#ifndef WIFI_OFFLINE_AP_TIMEOUT
+#define WIFI_OFFLINE_AP_TIMEOUT 0 // >0: offline selama ini (ms) -> hapus kredensial & mode AP
+#endif
+
+// Jalan kembali ke portal tanpa menghapus kredensial: setelah offline selama
+// ini soft-AP dinyalakan di samping STA (WIFI_AP_STA). Reconnect & scan tetap
+// berjalan; soft-AP dimatikan lagi begitu jaringan tersimpan kembali.
+#ifndef WIFI_OFFLINE_PORTAL_DELAY
+#define WIFI_OFFLINE_PORTAL_DELAY (5UL * 60 * 1000) // 5 menit, 0 = tidak pernah
+#endif
+bool offlinePortalActive = false; // Soft-AP portal aktif bersama STA
 
 // EEPROM Addresses
 const int EEPROM_SSID_ADDR = 0;
 const int EEPROM_PASS_ADDR = 50;
 
+// Cache halaman admin: URL stylesheet memuat hash isinya sehingga boleh
+// di-cache selamanya; halaman HTML selalu divalidasi ulang lewat ETag (304)
+#define WEB_CACHE_VERSIONED "public, max-age=31536000, immutable"
+#define WEB_CACHE_PAGE "no-cache"
+
 // Objek Global
 DNSServer dnsServer;
-WebServer server(80);
+AsyncWebServer server(80); // Dilayani task async_tcp, tidak perlu dipanggil dari loop()
 IPAddress apIP(192, 168, 4, 1);
 
+// Handler web berjalan di task async_tcp dan tidak boleh blocking. Aksi yang
+// butuh koneksi WiFi, HTTPS atau restart hanya ditandai di sini lalu
+// dijalankan loop() lewat handlePortalActions().
+enum PortalAction : uint8_t
+{
+    PORTAL_CONNECT = 1 << 0,      // Coba kredensial baru dari /connect
+    PORTAL_FORGET = 1 << 1,       // Lupakan jaringan lalu restart
+    PORTAL_RESET = 1 << 2,        // Hapus kredensial lalu restart
+    PORTAL_CHECK_UPDATE = 1 << 3, // Ambil versi firmware terbaru
+    PORTAL_START_UPDATE = 1 << 4  // Unduh & pasang firmware
+};
+std::atomic<uint8_t> portalActions(0);
+
+enum PortalConnectState : uint8_t
+{
+    PORTAL_CONNECT_IDLE,
+    PORTAL_CONNECT_PENDING,
+    PORTAL_CONNECT_CONNECTED, // Kredensial baru tersimpan, perangkat restart
+    PORTAL_CONNECT_REVERTED,  // Kembali ke jaringan sebelumnya
+    PORTAL_CONNECT_FAILED     // Kredensial dihapus, restart ke mode AP
+};
+const char *PORTAL_CONNECT_STATE_NAMES[] = {"idle", "connecting", "connected", "reverted", "failed"};
+
+// String hasil hanya ditulis loop() sebelum state final diset, dan hanya
+// dibaca handler setelah state final terlihat
+struct PortalConnect
+{
+    String ssid;       // Diisi handleConnect()
+    String password;
+    String resultSsid; // Jaringan yang dipakai setelah percobaan
+    String resultIp;
+    volatile PortalConnectState state;
+    PortalConnect() : state(PORTAL_CONNECT_IDLE) {}
+} portalConnect;
+
+struct WebAssetStats
+{
+    uint32_t served;      // Respons 200 dari flash
+    uint32_t notModified; // Respons 304 karena ETag cocok
+    uint32_t bytes;       // Byte gzip yang dikirim
+    WebAssetStats() : served(0), notModified(0), bytes(0) {}
+} webAssetStats; // Hanya disentuh task async_tcp
+
 // Status Variables
 bool isAPMode = false;
 String lastError = "";
@@ -103,9 +390,65 @@ const unsigned long OLED_UPDATE_INTERVAL = 1000; // Update setiap 1 detik
 // ======= KONFIGURASI RFID =======
 // =========================
 
-// RFID Block Configuration
-const byte blocks[] = {4, 5, 6}; // Blok yang akan dibaca: NISN, NIP, Nama
-const byte total_blocks = sizeof(blocks) / sizeof(blocks[0]);
+// Cara mendekode isi field dari byte blok kartu
+enum FieldEncoding
+{
+    FIELD_TEXT,  // Karakter printable, whitespace di awal/akhir dibuang
+    FIELD_DIGITS // Hanya angka 0-9
+};
+
+// Satu field data di kartu MIFARE Classic
+struct CardField
+{
+    byte block;  // Nomor blok absolut
+    byte offset; // Posisi awal di dalam blok
+    byte length; // Panjang field (offset + length <= 16)
+    const char *name;
+    FieldEncoding encoding;
+};
+
+// RFID Block Configuration: layout data di kartu, urutannya sama dengan
+// kolom yang dikirim (NISN, NIP, Nama)
+const CardField CARD_LAYOUT[] = {
+    {4, 0, 16, "NISN", FIELD_TEXT},
+    {5, 0, 16, "NIP", FIELD_TEXT},
+    {6, 0, 16, "Nama", FIELD_TEXT},
+};
+constexpr byte CARD_FIELD_COUNT = sizeof(CARD_LAYOUT) / sizeof(CARD_LAYOUT[0]);
+static_assert(CARD_FIELD_COUNT == 3, "Format pengiriman mengharapkan 3 kolom: NISN, NIP, Nama");
+
+#define MAX_READ_STEPS 16
+
+// Satu langkah rencana baca: autentikasi sektor (jika sektor baru) lalu satu MIFARE_Read
+struct ReadStep
+{
+    byte block;
+    bool authenticate;
+};
+
+// Rencana baca yang dibangun sekali dari CARD_LAYOUT: blok unik, dikelompokkan
+// per sektor, dengan satu autentikasi per sektor
+struct CardReadPlan
+{
+    ReadStep steps[MAX_READ_STEPS];
+    byte count;
+    byte authCount;
+
+    CardReadPlan() : count(0), authCount(0) {}
+};
+
+// Waktu baca per field (mikrodetik), termasuk autentikasi sektor bila ada
+struct CardReadStats
+{
+    uint32_t lastFieldMicros[CARD_FIELD_COUNT];
+    uint64_t totalFieldMicros[CARD_FIELD_COUNT];
+    uint32_t fullReads;
+
+    CardReadStats() : lastFieldMicros{}, totalFieldMicros{}, fullReads(0) {}
+};
+
+CardReadPlan cardReadPlan;
+CardReadStats cardReadStats;
 byte readBlockData[18];
 byte bufferLen = 18;
 
@@ -114,32 +457,294 @@ MFRC522 mfrc522(SS_PIN, RST_PIN);
 MFRC522::MIFARE_Key key;
 MFRC522::StatusCode status;
 
-// Struktur data RFID
+// Struktur data RFID. Berukuran tetap dan trivially copyable sehingga satu
+// record bisa lewat dari pembacaan kartu, antrian antar-core, journal, sampai
+// serialisasi tanpa alokasi heap.
 struct RFIDData {
-    String uid;
-    String blockData[3]; // [NISN, NIP, Nama]
-    unsigned long timestamp;
+    uint8_t uidLength;
+    uint8_t uid[10];       // UID mentah (maks 10 byte)
+    char blockData[3][17]; // [NISN, NIP, Nama]
+    uint32_t timestamp;
+    uint32_t sequence;     // Nomor urut per perangkat mulai 1, diisi journalAppend()
+    uint32_t captureTime;  // Waktu scan, detik Unix UTC; 0 = jam belum sinkron saat scan
+    uint32_t bootId;       // Boot asal timestamp, untuk memetakan captureTime belakangan
 };
 
-// Ring buffer untuk penyimpanan data RFID
-struct RFIDBuffer
+static_assert(std::is_trivially_copyable<RFIDData>::value, "RFIDData harus trivially copyable");
+static_assert(sizeof(RFIDData) <= JOURNAL_MAX_PAYLOAD, "RFIDData harus muat dalam satu frame journal");
+
+// Antrian lock-free satu produsen (task RFID) dan satu konsumen (loop()).
+// Tidak ada alokasi maupun mutex, kapasitas harus pangkat dua.
+template <typename T, uint32_t Capacity>
+struct SpscRing
 {
-    RFIDData data[MAX_BUFFER_SIZE];
-    int head;
-    int tail;
-    int count;
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity harus pangkat dua");
+
+    T slots[Capacity];
+    std::atomic<uint32_t> head; // Hanya ditulis oleh konsumen
+    std::atomic<uint32_t> tail; // Hanya ditulis oleh produsen
+
+    SpscRing() : head(0), tail(0) {}
+
+    bool push(const T &item)
+    {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) >= Capacity) return false;
+
+        slots[t & (Capacity - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        if (!peek(item)) return false;
+        discard();
+        return true;
+    }
+
+    // Salin item terdepan tanpa menghapusnya dari antrian
+    bool peek(T &item) const
+    {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+
+        item = slots[h & (Capacity - 1)];
+        return true;
+    }
+
+    // Hapus item terdepan setelah peek() berhasil
+    void discard()
+    {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    uint32_t size() const
+    {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+};
+
+// Satu slot hash table UID cache. Struktur yang sama disimpan apa adanya
+// di UID_CACHE_FILE, slot ke-i berada di offset tetap.
+struct UIDCacheEntry
+{
+    uint8_t uidLength;     // 0 = slot kosong
+    uint8_t uid[10];
+    uint8_t tapsSinceVerify;
+    char blockData[3][17]; // [NISN, NIP, Nama]
+    uint32_t crc;
+};
+
+// Hash table open-addressing (linear probing) dengan UID sebagai key
+struct UIDCache
+{
+    UIDCacheEntry entries[UID_CACHE_CAPACITY];
+    uint32_t dirty[UID_CACHE_CAPACITY / 32]; // Slot yang belum ditulis ke flash
+    uint32_t count;
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t mismatches; // Isi kartu berbeda dari cache saat revalidasi
+
+    UIDCache() : count(0), hits(0), misses(0), mismatches(0) {}
+};
+
+// Posisi di dalam journal: nomor segmen + offset byte di dalam file segmen
+struct JournalCursor
+{
+    uint32_t segment;
+    uint32_t offset;
+};
+
+// Header tiap record di journal. CRC menutupi payload sehingga record yang
+// terpotong karena mati listrik bisa dikenali dan dilewati saat boot.
+struct __attribute__((packed)) JournalFrameHeader
+{
+    uint16_t magic;
+    uint16_t length;
+    uint32_t crc;
+};
+
+// Cursor yang disimpan di flash. Ada dua slot yang ditulis bergantian,
+// slot dengan generation tertinggi dan CRC valid yang dipakai saat boot.
+struct __attribute__((packed)) JournalCursorRecord
+{
+    uint32_t magic;
+    uint32_t generation;
+    JournalCursor head;
+    uint32_t tailSegment;
+    uint32_t nextSequence;
+    uint32_t crc;
+};
+
+// Journal append-only untuk penyimpanan data RFID
+struct AttendanceJournal
+{
+    JournalCursor head;   // Record tertua yang belum dikonfirmasi terkirim
+    JournalCursor tail;   // Posisi tulis berikutnya
+    uint32_t pendingCount;
+    uint32_t cursorGeneration;
+    uint32_t nextSequence; // Sequence untuk record berikutnya, tidak pernah mundur
+    File tailFile;        // Segmen aktif, dibiarkan terbuka untuk append
+    bool mounted;
 
     // Constructor untuk inisialisasi
-    RFIDBuffer() : head(0), tail(0), count(0) {}
+    AttendanceJournal() : head{1, 0}, tail{1, 0}, pendingCount(0), cursorGeneration(0), nextSequence(1), mounted(false) {}
 };
 
 // Deklarasi variabel global
-RFIDBuffer rfidBuffer; // Inisialisasi buffer sebagai variabel global
+AttendanceJournal journal;  // Journal di LittleFS, dipakai loop() & task upload
+SemaphoreHandle_t journalMutex = nullptr;
+SpscRing<RFIDData, SCAN_QUEUE_SIZE> scanQueue; // Task RFID -> loop()
+UIDCache uidCache;                   // Dipakai task RFID, di-flush oleh loop()
+SemaphoreHandle_t uidCacheMutex = nullptr;
+
+// Pemetaan millis() -> UTC, diperbarui setiap sinkronisasi SNTP. Scan
+// sebelum sinkron pertama dipetakan saat upload selama masih di boot yang
+// sama (bootId).
+struct ClockState
+{
+    bool valid;           // offsetMs bisa dipakai
+    bool bridged;         // Valid dari RTC setelah soft reboot, belum sinkron ulang
+    int64_t offsetMs;     // UTC (ms) - millis()
+    uint32_t bootId;      // Acak per boot, tidak pernah 0 setelah initClock()
+    uint32_t syncs;
+    unsigned long lastSyncMillis;
+
+    ClockState() : valid(false), bridged(false), offsetMs(0), bootId(0), syncs(0), lastSyncMillis(0) {}
+};
+
+// Di RTC slow memory: tidak di-nol-kan saat soft reboot (restart, panic,
+// watchdog). Waktu sistem ESP32 tetap berjalan dari timer RTC selama itu,
+// jadi jam langsung valid setelah soft reboot tanpa menunggu SNTP.
+struct ClockBridge
+{
+    uint32_t magic;
+    uint32_t lastSyncUtc; // Detik UTC sinkronisasi terakhir
+    uint32_t syncs;       // Total sinkronisasi sejak power-on
+    uint32_t crc;
+};
+
+// Salinan pemetaan jam untuk satu payload. Semua pass render batch (dry run
+// Content-Length, kirim, retry) memakai salinan yang sama agar sinkronisasi
+// SNTP di tengah jalan tidak mengubah panjang payload.
+struct ClockSnapshot
+{
+    bool valid;
+    int64_t offsetMs;
+    uint32_t bootId;
+};
+
+ClockState clockState;                               // Ditulis callback SNTP, dibaca task RFID & upload
+RTC_NOINIT_ATTR ClockBridge clockBridge;
+portMUX_TYPE clockMux = portMUX_INITIALIZER_UNLOCKED; // Menjaga offsetMs (64-bit)
+unsigned long lastHeapReport = 0;
+
+// Tabel kartu yang baru diterima untuk membuang tap ganda kartu yang sama.
+// Hanya diakses oleh task RFID.
+#define RECENT_UID_CAPACITY 16
+// Jendela dihitung dari scan terakhir yang diterima, jadi kartu yang ditempel
+// ulang setiap <jendela tetap tercatat sekali per jendela.
+#ifndef DUPLICATE_SCAN_WINDOW
+#define DUPLICATE_SCAN_WINDOW 30000UL // Tap ulang kartu yang sama dalam jendela ini (ms) diabaikan
+#endif
+#ifndef DUPLICATE_SCAN_SLIDING
+#define DUPLICATE_SCAN_SLIDING 0 // 1: tap yang diabaikan ikut memperpanjang jendela
+#endif
+
+struct RecentUIDEntry
+{
+    uint32_t uidHash;
+    unsigned long lastSeen; // Waktu scan terakhir kartu ini diterima
+    bool used;
+};
 
-// Status tracking untuk debouncing dan feedback
-unsigned long lastSuccessfulRead = 0;
-const unsigned long READ_COOLDOWN = 500; // 500ms cooldown antara pembacaan
-bool isProcessing = false;
+struct RecentUIDTable
+{
+    RecentUIDEntry entries[RECENT_UID_CAPACITY];
+    uint32_t hits;  // Kartu ditemukan di tabel
+    uint32_t drops; // Tap duplikat yang dibuang
+
+    RecentUIDTable() : entries{}, hits(0), drops(0) {}
+};
+
+RecentUIDTable recentUIDs;
+
+// Status tracking untuk feedback
+volatile bool isProcessing = false;       // RFID diblokir (antena dimatikan oleh task RFID)
+volatile bool rfidAcceptingScans = false; // Diatur loop(): GScript siap & journal belum penuh
+volatile bool rfidRestartRequested = false; // Task RFID minta loop() menjalankan recovery
+TaskHandle_t rfidTaskHandle = nullptr;
+TaskHandle_t loopTaskHandle = nullptr;      // Dibangunkan task RFID setelah push ke scanQueue
+#if RFID_USE_IRQ
+bool rfidCardSignalled = false; // Jawaban REQA diterima lewat IRQ, hanya dipakai task RFID
+uint32_t rfidSpuriousIrqs = 0;  // RxIRq tanpa ATQA valid (noise/tabrakan), diabaikan
+#endif
+
+// Tahapan pembacaan kartu. Setiap pemanggilan processRFIDCard() hanya
+// menjalankan satu tahap lalu kembali ke loop().
+enum ScanState
+{
+    SCAN_IDLE,         // Menunggu kartu baru (REQA)
+    SCAN_SELECT,       // Anticollision + select untuk mendapatkan UID
+    SCAN_AUTHENTICATE, // Autentikasi blok yang akan dibaca
+    SCAN_READ,         // Baca blok yang sudah terautentikasi
+    SCAN_ENQUEUE,      // Simpan hasil ke journal
+    SCAN_REVALIDATE,   // Bandingkan isi kartu dengan UID cache
+    SCAN_HALT          // Tutup sesi kartu
+};
+
+// Konteks sesi kartu yang sedang berjalan
+struct ScanContext
+{
+    ScanState state;
+    byte stepIndex;    // Langkah cardReadPlan yang sedang dijalankan
+    uint8_t failureCount;
+    bool fromCache;    // Identitas diambil dari UID cache
+    bool revalidating; // Blok tetap dibaca setelah enqueue untuk memeriksa cache
+    unsigned long stateStart;
+    uint32_t stepStartMicros;
+    uint32_t uidHash;  // Hash UID untuk deteksi tap ganda
+    unsigned long stallStart; // Mulai menunggu antrian scan penuh (0 = tidak menunggu)
+    RFIDData record;
+
+    ScanContext() : state(SCAN_IDLE), stepIndex(0), failureCount(0), fromCache(false), revalidating(false), stateStart(0), stepStartMicros(0), uidHash(0), stallStart(0) {}
+};
+
+ScanContext scanContext;
+const uint8_t MAX_SCAN_FAILURES = 3;
+
+// Tangga pemulihan reader. Setiap kali MAX_SCAN_FAILURES tercapai tanpa scan
+// berhasil di antaranya, tier berikutnya dicoba; restart ESP hanya tier terakhir.
+enum RecoveryTier
+{
+    RECOVERY_STOP_CRYPTO,   // Tutup sesi kartu & bersihkan FIFO/IRQ
+    RECOVERY_SOFT_RESET,    // Soft reset MFRC522 + konfigurasi ulang register
+    RECOVERY_ANTENNA_CYCLE, // Matikan medan RF sebentar agar kartu ikut reset
+    RECOVERY_REINIT,        // Hard reset lewat pin RST (resetRFIDModule)
+    RECOVERY_RESTART,       // Kirim journal lalu ESP.restart()
+    RECOVERY_TIER_COUNT
+};
+
+const char *const RECOVERY_TIER_NAMES[RECOVERY_TIER_COUNT] = {"stop_crypto", "soft_reset", "antenna_cycle", "reinit", "restart"};
+const unsigned long RECOVERY_LADDER_RESET = 300000; // Tangga mulai dari bawah lagi setelah 5 menit tanpa recovery
+const unsigned long ANTENNA_CYCLE_OFF_MS = 50;
+
+struct RecoveryStats
+{
+    uint8_t nextTier;
+    unsigned long lastRecovery;
+    uint32_t attempts[RECOVERY_TIER_COUNT];
+    uint32_t healthy[RECOVERY_TIER_COUNT];       // Reader menjawab lagi setelah tier ini
+    uint32_t lastDowntimeMs[RECOVERY_TIER_COUNT];
+    uint32_t totalDowntimeMs[RECOVERY_TIER_COUNT];
+
+    RecoveryStats() : nextTier(RECOVERY_STOP_CRYPTO), lastRecovery(0), attempts{}, healthy{}, lastDowntimeMs{}, totalDowntimeMs{} {}
+};
+
+RecoveryStats recoveryStats; // Ditulis task RFID, dibaca handleStatus()
+volatile unsigned long scanFeedbackUntil = 0;               // Nama hasil scan tampil sampai waktu ini
+const unsigned long SCAN_FEEDBACK_DURATION = 1000; // Lama nama ditampilkan (ms)
 
 // =========================
 // ======= GOOGLE APPS CONFIGURATION =======
@@ -153,20 +758,379 @@ String GScriptURL = String("/macros/s/") + GScriptId + "/exec";
 
 // Connection Configuration
 const int HTTP_TIMEOUT = 10000; // 10 detik timeout
-const int MAX_RETRIES = 3;      // Maksimum percobaan koneksi
-const int RETRY_DELAY = 1000;   // Delay antar percobaan (1 detik)
+
+// Retry policy: jeda antar percobaan tumbuh eksponensial dengan jitter.
+// Setelah GSCRIPT_BREAKER_THRESHOLD kegagalan berturut-turut circuit open:
+// tidak ada request sampai backoff habis, lalu satu probe test_connection
+// (half-open) menentukan circuit kembali closed atau open lagi.
+const unsigned long GSCRIPT_BACKOFF_BASE = 2000;   // Jeda setelah kegagalan pertama
+const unsigned long GSCRIPT_BACKOFF_MAX = 300000;  // Batas atas jeda (5 menit)
+const int GSCRIPT_BREAKER_THRESHOLD = 5;           // Kegagalan berturut-turut sebelum open
+
+enum BreakerState
+{
+    BREAKER_CLOSED,    // Request normal
+    BREAKER_OPEN,      // Request ditolak sampai nextAttemptAt
+    BREAKER_HALF_OPEN  // Satu probe sedang diizinkan
+};
+
+const char *const BREAKER_STATE_NAMES[] = {"closed", "open", "half-open"};
+
+struct GScriptBreaker
+{
+    BreakerState state;
+    int consecutiveFailures;
+    unsigned long nextAttemptAt; // Request berikutnya tidak sebelum millis() ini
+    unsigned long lastBackoffMs;
+    uint32_t trips;              // Closed -> open
+    uint32_t probes;             // Open -> half-open
+
+    GScriptBreaker() : state(BREAKER_CLOSED), consecutiveFailures(0), nextAttemptAt(0), lastBackoffMs(0), trips(0), probes(0) {}
+};
+
+GScriptBreaker gscriptBreaker; // Hanya diubah task upload (dan setup())
 
 // Status Variables
-bool isGScriptConnected = false;
-unsigned long lastConnectionCheck = 0;
-const unsigned long CONNECTION_CHECK_INTERVAL = 300000; // Check setiap 5 menit
+volatile bool isGScriptConnected = false;
+
+// Kesehatan koneksi diambil dari hasil request sungguhan (upload & probe).
+// test_connection hanya dikirim bila tidak ada request berhasil selama
+// GSCRIPT_IDLE_PROBE_INTERVAL, di task upload tanpa menyentuh antena.
+#ifndef GSCRIPT_IDLE_PROBE_INTERVAL
+#define GSCRIPT_IDLE_PROBE_INTERVAL 300000 // 5 menit tanpa request berhasil
+#endif
+
+struct GScriptHealth
+{
+    unsigned long lastSuccess; // millis() request terakhir yang berhasil, 0 = belum pernah
+    unsigned long lastFailure;
+    uint32_t idleProbes;       // test_connection karena idle (bukan karena terputus)
+    uint32_t idleProbeFailures;
+
+    GScriptHealth() : lastSuccess(0), lastFailure(0), idleProbes(0), idleProbeFailures(0) {}
+};
 
-const int MIN_BATCH_SIZE = 10;              // Minimal data sebelum dikirim
-const unsigned long SEND_TIMEOUT = 60000;    // Timeout 1 menit
+GScriptHealth gscriptHealth;
+
+const int MAX_BATCH_SIZE = 100;             // Maksimum record per batch (saat ada backlog)
 unsigned long lastDataTime = 0;              // Waktu data terakhir masuk
+const unsigned long UPLOAD_FLUSH_TIMEOUT = 20000;  // Batas tunggu upload sebelum restart
+const unsigned long BACKLOG_DRAIN_INTERVAL = 3000; // Jeda minimum antar batch saat menguras backlog
+
+// Rentang sequence inklusif, dipakai jawaban server (ack) insert_rows
+struct SequenceRange
+{
+    uint32_t first;
+    uint32_t last;
+};
+
+#define ACK_MAX_RANGES 8   // Rentang accepted yang disimpan per jawaban / per batch
+#define ACK_MAX_BYTES 1024 // Jawaban setelah batas ini diabaikan
+#define MAX_ROW_REJECTS 5  // Baris yang ditolak sebanyak ini berturut-turut dipindah ke dead letter
+#define DEAD_LETTER_FILE "/rejected.csv"
+#define DEAD_LETTER_MAX_BYTES 16384 // Setelah penuh baris ditolak hanya dihitung
+
+// Batch tersegel: rentang record journal [from, next). Isinya dibaca langsung
+// dari journal saat dikirim; head journal baru dimajukan ke `next` setelah
+// server menerima batch ini.
+struct UploadBatch
+{
+    JournalCursor from;
+    JournalCursor next;
+    int count;
+    uint8_t ackedCount;                 // Baris di depan yang sudah di-ack tapi belum bisa di-commit
+    SequenceRange acked[ACK_MAX_RANGES]; // tidak dikirim ulang
+    uint32_t rejectSequence;            // Baris terdepan yang ditolak server
+    uint8_t rejectCount;                // Berapa kali berturut-turut baris itu ditolak
+};
+
+// loop() menyegel batch dari journal ke antrian, task upload mengirimnya di
+// background. Scan tidak pernah menunggu upload; hanya kapasitas journal
+// yang membatasi penerimaan kartu.
+struct UploadPipeline
+{
+    QueueHandle_t queue;
+    TaskHandle_t task;
+    JournalCursor sealed;         // Record sebelum posisi ini sudah ada di batch tersegel
+    uint32_t sealedRecords;       // Record tersegel yang belum di-commit (dijaga journalMutex)
+    uint32_t batchesSent;
+    uint32_t failedAttempts;
+    uint32_t partialAcks;         // Jawaban yang hanya menerima sebagian baris
+    uint32_t deadLettered;        // Baris yang ditolak permanen lalu dilepas dari journal
+    uint32_t lastDeadLetter;      // Sequence baris terakhir yang dilepas
+    uint32_t lastUploadMs;        // Durasi upload batch terakhir yang berhasil
+    uint32_t rawBytes;            // Payload batch sebelum gzip, semua percobaan kirim
+    uint32_t wireBytes;           // Payload batch yang benar-benar dikirim
+    uint32_t ringStalls;          // Task RFID menunggu karena antrian scan penuh
+    uint32_t ringStallMs;
+    uint32_t admissionStalls;     // Scan ditolak karena journal penuh
+    uint32_t admissionStallMs;
+    unsigned long admissionStallStart;
+
+    UploadPipeline() : queue(nullptr), task(nullptr), sealed{1, 0}, sealedRecords(0), batchesSent(0), failedAttempts(0), partialAcks(0), deadLettered(0), lastDeadLetter(0),
+                       lastUploadMs(0), rawBytes(0), wireBytes(0),
+                       ringStalls(0), ringStallMs(0), admissionStalls(0), admissionStallMs(0), admissionStallStart(0) {}
+};
+
+UploadPipeline uploader;
+
+// Ukuran batch & deadline flush dipilih dari laju scan dan latensi upload
+// (EWMA). Target: record sampai ke server paling lambat MAX_DELIVERY_DELAY
+// setelah di-scan, dengan request sesedikit mungkin per scan.
+#ifndef MAX_DELIVERY_DELAY
+#define MAX_DELIVERY_DELAY 60000   // Batas delay scan -> server (ms)
+#endif
+const float SCHEDULER_EWMA_ALPHA = 0.2f;           // Bobot sampel baru
+const unsigned long MIN_FLUSH_BUDGET = 2000;       // Waktu tunggu minimum meski upload lambat
+
+enum FlushReason
+{
+    FLUSH_NONE,
+    FLUSH_SIZE,     // Target ukuran batch tercapai
+    FLUSH_DEADLINE, // Record tertua hampir melewati MAX_DELIVERY_DELAY
+    FLUSH_BACKLOG   // Backlog sudah mencapai MAX_BATCH_SIZE
+};
+
+const char *const FLUSH_REASON_NAMES[] = {"none", "size", "deadline", "backlog"};
+
+struct BatchScheduler
+{
+    float arrivalIntervalMs;    // EWMA jarak antar scan
+    float uploadLatencyMs;      // EWMA durasi upload batch yang berhasil
+    unsigned long lastArrival;  // Timestamp scan terakhir
+    unsigned long oldestUnsealed; // Timestamp record tertua yang belum disegel, 0 = tidak ada
+    int targetSize;             // Keputusan terakhir
+    unsigned long flushBudgetMs;
+    FlushReason lastReason;
+    int lastBatchSize;
+    unsigned long lastBatchAgeMs; // Umur record tertua saat batch terakhir disegel
+
+    BatchScheduler() : arrivalIntervalMs(MAX_DELIVERY_DELAY), uploadLatencyMs(0), lastArrival(0), oldestUnsealed(0),
+                       targetSize(1), flushBudgetMs(MAX_DELIVERY_DELAY), lastReason(FLUSH_NONE), lastBatchSize(0), lastBatchAgeMs(0) {}
+};
+
+BatchScheduler batchScheduler;
+
+// Format payload batch. Dipilih saat test_connection: firmware mengirim
+// "formats":"csv1" dan endpoint yang mendukung CSV menjawab "Success csv1".
+// Endpoint lama cukup menjawab "Success" dan tetap menerima JSON.
+//
+// Kompresi dinegosiasikan terpisah: firmware mengirim "encodings":"gzip" dan
+// endpoint yang bisa membuka gzip menambahkan "gzip" di jawaban ("Success
+// csv1 gzip"). Body format apa pun lalu dikirim sebagai gzip dengan header
+// Content-Encoding: gzip dan parameter URL encoding=gzip (doPost tidak bisa
+// membaca header; buka dengan Utilities.ungzip pada e.postData).
+//
+// Kontrak decoder csv1 (doPost di Apps Script):
+//   - Parameter URL: command=insert_rows_csv, sheet_name=<nama sheet>
+//   - Body (text/csv, UTF-8): satu baris per record "NISN,NIP,Nama\n"
+//   - Field yang mengandung koma atau kutip dibungkus kutip, kutip di
+//     dalamnya digandakan (RFC 4180); field kosong tetap ditulis ("1234,,Budi")
+//   - Kolom ke-4 sequence dan ke-5 waktu scan (sama dengan JSON):
+//     "NISN,NIP,Nama,seq,waktu\n"
+//   - Parameter URL device & batch_id sama dengan field JSON di bawah
+//   - Jawaban sama dengan insert_rows: "Success <jumlah baris>"
+//
+// Pengiriman at-least-once: batch dikirim ulang sampai server menjawab
+// Success, jadi server wajib idempoten:
+//   - Setiap baris membawa sequence per perangkat yang selalu naik (kolom
+//     ke-4 di "values"). Server men-dedupe pada pasangan persis ("device",
+//     sequence): baris yang pasangannya sudah tersimpan dilewati, baris lain
+//     disimpan walau sequence-nya lebih kecil dari yang sudah ada. Jangan
+//     memakai sequence tertinggi sebagai batas: baris yang ditolak lalu
+//     dikirim ulang setelah baris sesudahnya diterima akan ikut terlewati.
+//   - Baris yang dilewati karena sudah tersimpan dijawab sebagai diterima
+//     (masuk "accepted" atau dihitung di "Success <n>"), bukan "rejected",
+//     supaya perangkat melepasnya dari journal.
+//   - "batch_id" (<device>-<seq pertama>-<seq terakhir>) sama untuk setiap
+//     retry batch yang sama; server yang sudah memproses batch_id itu cukup
+//     menjawab Success lagi. Setelah commit parsial, sisa baris dikirim
+//     dengan batch_id baru, jadi dedupe per baris tetap wajib.
+//
+// Kolom ke-5 adalah waktu scan sebenarnya dalam detik Unix UTC. Nilai 0
+// berarti perangkat tidak tahu (jam belum sinkron dan scan dari boot
+// sebelumnya); hanya untuk baris itu server memakai waktu terima.
+enum BatchFormat
+{
+    BATCH_FORMAT_JSON, // {"command":"insert_rows",...,"values":[[...],...]}
+    BATCH_FORMAT_CSV   // csv1, lihat kontrak di atas
+};
+
+const char *const BATCH_FORMAT_NAMES[] = {"json", "csv1"};
+const char *deviceId(); // MAC eFuse sebagai hex, untuk sequence & batch_id
+volatile BatchFormat gscriptBatchFormat = BATCH_FORMAT_JSON; // Hasil negosiasi test_connection
+volatile bool gscriptBatchGzip = false;                      // Endpoint menerima body gzip
+
+// Deflate (RFC 1951) dalam bungkus gzip untuk payload batch, dengan memori
+// tetap dan tanpa alokasi. Hanya satu blok Huffman tetap dan LZ77 satu
+// kandidat per hash di jendela DEFLATE_WINDOW byte: baris batch mirip satu
+// sama lain (prefix NISN/NIP, nama berulang, sequence & waktu berurutan),
+// jadi match di jendela kecil sudah menangkap sebagian besar redundansi.
+// tdefl (miniz di ROM) butuh state >100 KB, tidak muat di heap bersama TLS.
+#define DEFLATE_WINDOW 1024    // Jarak match maksimum, juga batas satu write()
+#define DEFLATE_HASH_BITS 9
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_OUT_MAX(n) ((n) * 9 / 8 + 24) // Output terburuk untuk n byte input, termasuk header & trailer gzip
+
+class GzipEncoder
+{
+public:
+    void begin();
+    size_t write(const uint8_t *data, size_t length, uint8_t *out); // Return jumlah byte gzip di out
+    size_t finish(uint8_t *out);                                    // Kode akhir blok + trailer gzip
+    bool finished() const { return done; }
+
+private:
+    void putBits(uint32_t value, uint8_t count);
+    void putCode(uint16_t code, uint8_t length); // Kode Huffman ditulis MSB dulu
+    void putSymbol(uint16_t symbol);             // Literal/panjang dengan tabel Huffman tetap
+    void putMatch(uint16_t length, uint16_t distance);
+    void putHeader();
+    uint16_t hashAt(size_t pos) const;
+
+    uint8_t history[DEFLATE_WINDOW * 2];
+    uint16_t hashHead[1 << DEFLATE_HASH_BITS]; // Posisi + 1 di history, 0 = kosong
+    size_t historyLength;
+    uint32_t bitBuffer;
+    uint8_t bitCount;
+    uint8_t *out;
+    size_t outLength;
+    uint32_t crc;
+    uint32_t inputLength;
+    bool headerPending;
+    bool done;
+};
+
+// Payload insert_rows sebagai Stream untuk HTTPClient::sendRequest().
+// Record dibaca dari journal per BATCH_STREAM_WINDOW dan di-render satu baris
+// setiap kali (lalu di-gzip bila dinegosiasikan), jadi memori yang dipakai
+// tetap (jendela + satu baris) berapa pun ukuran batch. Panjang payload
+// dihitung lebih dulu dengan dry run untuk header Content-Length; deflate
+// deterministik sehingga pengiriman sebenarnya menghasilkan byte yang sama.
+#define BATCH_ROW_MAX 136 // ",[" + 3 x ("" + 16 x 2 escape) + 4 koma + sequence & waktu (10 digit) + "]"
+
+class BatchPayloadStream : public Stream
+{
+public:
+    size_t begin(const UploadBatch &source, BatchFormat format, bool gzip); // Return panjang payload di wire
+    void rewind();                           // Mulai ulang dari awal dengan panjang penuh (untuk retry)
+    const char *idempotencyKey() const { return key; } // Valid setelah begin()
+    size_t rawLength() const { return plainTotal; }     // Panjang sebelum gzip
+
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t write(uint8_t) override { return 0; }
+
+private:
+    bool fill();                // Isi chunk dengan byte wire berikutnya
+    size_t renderNext(char *out); // Render satu bagian payload polos (boleh kosong)
+
+    UploadBatch batch;
+    BatchFormat format;
+    bool gzip;
+    ClockSnapshot clock; // Pemetaan jam saat begin(), untuk baris tanpa captureTime
+    GzipEncoder encoder;
+    JournalCursor cursor;
+    int recordsLoaded;
+    int windowCount;
+    int windowIndex;
+    RFIDData window[BATCH_STREAM_WINDOW];
+    char plain[BATCH_ROW_MAX + 1];               // Bagian polos sebelum gzip
+    char chunk[DEFLATE_OUT_MAX(BATCH_ROW_MAX + 1)]; // Byte wire yang sedang dibaca
+    size_t chunkLength;
+    size_t chunkPos;
+    uint8_t phase; // 0 = prefix, 1 = baris, 2 = suffix, 3 = selesai
+    bool firstRow;
+    size_t total;         // Panjang payload di wire hasil dry run di begin()
+    size_t plainTotal;    // Panjang payload polos hasil dry run
+    size_t plainRendered; // Byte polos yang sudah di-render sejak rewind()
+    size_t remaining; // Byte yang belum dibaca sejak rewind()
+    uint32_t firstSequence;
+    uint32_t lastSequence;
+    char key[48];  // "<device>-<seq pertama>-<seq terakhir>"
+};
+
+BatchPayloadStream batchStream; // Hanya dipakai task upload
+
+// Jawaban insert_rows dibaca langsung dari HTTPClient::writeToStream()
+// dengan memori tetap, tanpa getString(). Dua bentuk diterima:
+//   - Teks lama "Success <n>": seluruh batch diterima
+//   - JSON {"accepted":[[first,last],...],"rejected":[[first,last],...]}
+//     berisi rentang sequence. Baris yang tidak ada di "accepted" dikirim
+//     ulang. Baris terdepan yang ada di "rejected" MAX_ROW_REJECTS kali
+//     berturut-turut dipindah ke DEAD_LETTER_FILE agar tidak menahan scan
+//     berikutnya. Rentang di luar ACK_MAX_RANGES diabaikan; barisnya dikirim
+//     ulang dan di-dedupe server lewat pasangan (device, sequence).
+// Baris yang ditolak dikirim ulang sesudah baris yang lebih baru diterima,
+// jadi kontrak idempoten di atas harus dedupe per pasangan, bukan memakai
+// sequence tertinggi; baris yang sudah tersimpan dijawab di "accepted".
+class BatchAckReader : public Stream
+{
+public:
+    void reset();
+    bool valid() const;                 // Jawaban lengkap dan dikenali
+    bool legacy() const { return mode == MODE_TEXT; }
+    uint32_t acceptedRows() const;
+    uint32_t rejectedRows() const { return rejected; }
+    bool sequenceRejected(uint32_t sequence) const;
+
+    size_t write(uint8_t c) override;
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+
+    SequenceRange accepted[ACK_MAX_RANGES];
+    uint8_t acceptedCount;
+    SequenceRange rejectedRanges[ACK_MAX_RANGES];
+    uint8_t rejectedCount;
+
+private:
+    void endNumber();
+    void endRange();
+
+    enum Mode : uint8_t { MODE_START, MODE_TEXT, MODE_JSON } mode;
+    char text[24];      // Teks lama, atau string JSON terakhir (terpotong)
+    uint8_t textLength;
+    char key[12];       // Key level atas yang sedang dibaca
+    bool inString;
+    bool escaped;
+    bool complete;
+    uint8_t depth;
+    uint8_t list;       // 0 = lain, 1 = accepted, 2 = rejected
+    bool sawAckList;    // Ada "accepted" atau "rejected"; JSON lain = error server
+    uint32_t number;
+    bool haveNumber;
+    uint32_t range[2];
+    uint8_t rangeLength;
+    uint32_t rejected;
+    size_t bytes;
+};
+
+BatchAckReader batchAck; // Hanya dipakai task upload
+
+// Koneksi TLS yang dipakai ulang (HTTP keep-alive), satu per host: request
+// pertama ke script.google.com lalu redirect ke script.googleusercontent.com.
+// Handshake hanya terjadi saat socket belum/tidak lagi terhubung.
+struct GScriptConnection
+{
+    const char *name;
+    WiFiClientSecure client;
+    HTTPClient http;
+    String host;
+    bool configured;
+    uint32_t handshakes;
+    uint32_t handshakeFailures;
+    uint32_t reuses;
+    uint32_t lastHandshakeMs;
+    uint32_t totalHandshakeMs;
+
+    GScriptConnection(const char *name) : name(name), configured(false), handshakes(0), handshakeFailures(0), reuses(0), lastHandshakeMs(0), totalHandshakeMs(0) {}
+};
 
-int gScriptConnectionFailureCount = 0;
-const int MAX_GSCRIPT_CONNECTION_FAILURES = 5;
+GScriptConnection scriptConnection("script");     // script.google.com
+GScriptConnection redirectConnection("redirect"); // Host hasil redirect 302
 
 // =========================
 // ======= OTA CONFIGURATION =======
@@ -200,8 +1164,10 @@ bool versionCheckFailed = false;
 void checkFirmwareUpdate();
 void performUpdate(Stream &updateSource, size_t updateSize);
 void updateFirmware();
-void handleOTAUpdate();
-void handleCheckUpdate();
+void handleOTAUpdate(AsyncWebServerRequest *request);
+void handleFirmwareInfo(AsyncWebServerRequest *request); // Versi terpasang & terbaru untuk halaman /ota
+void handleCheckUpdate(AsyncWebServerRequest *request);
+void handleStartUpdate(AsyncWebServerRequest *request);
 
 // =========================
 // ======= GOOGLE APPS DECLARATIONS =======
@@ -215,15 +1181,36 @@ void handleGoogleApps();           // Handler utama untuk loop()
 String getRedirectUrl(const String &response);
 
 // Data Management Functions
-bool sendBatchToGScript(const String &batchData); // Kirim batch data ke Google Script
-bool processPendingData();                        // Proses data yang pending di buffer
+bool sendBatchToGScript(const UploadBatch &batch); // Kirim batch data ke Google Script
+bool processPendingData();                        // Segel batch dari journal bila sudah waktunya
+void initUploader();                              // Buat antrian & task upload
+void uploadTask(void *parameter);                 // Kirim batch tersegel di background
+bool sealUploadBatch();                           // Segel rentang journal berikutnya ke antrian upload
+bool sendSealedBatch(UploadBatch &batch);         // Kirim lalu commit baris yang di-ack
+int commitAcknowledgedRows(UploadBatch &batch);   // Commit awalan batch yang sudah di-ack
+bool releaseRejectedRow(UploadBatch &batch);      // Lepas baris terdepan yang terus ditolak server
+bool sequenceAcknowledged(const UploadBatch &batch, uint32_t sequence);
+uint32_t unsealedRecordCount();                   // Record journal yang belum masuk batch
+void noteScanArrival(unsigned long timestamp);    // Update EWMA laju scan
+void noteUploadLatency(uint32_t durationMs);      // Update EWMA latensi upload
+void updateBatchSchedule();                       // Hitung target ukuran batch & budget flush
+bool backlogDraining();                           // Journal berisi lebih dari satu batch?
+uint32_t backlogDrainEtaSeconds();                // Perkiraan waktu sampai backlog habis
 
 // Connection Management Functions
-void checkGScriptConnection(); // Cek status koneksi secara periodik
+void checkGScriptConnection(); // Cek periodik, atau probe setelah backoff saat terputus
+void waitForGScript();         // Tunggu WiFi, OTA selesai & izin retry policy (task upload)
+unsigned long gscriptBackoffDelay(int failures); // Jeda eksponensial dengan jitter
+bool gscriptCallAllowed();     // Backoff habis? Open -> half-open
+unsigned long gscriptRetryWaitMs(); // Sisa jeda sebelum request berikutnya
+void recordGScriptSuccess();   // Reset backoff, circuit closed
+void recordGScriptFailure();   // Jadwalkan retry, open circuit bila perlu
+const char *gscriptHealthState(); // "healthy", "degraded" atau "down" untuk /status
 
 // Helper Functions
 String getRedirectUrl(const String &response);                 // Ekstrak URL redirect dari response
-bool handleHttpResponse(int httpCode, const String &response); // Handle HTTP response codes
+bool beginGScriptRequest(GScriptConnection &connection, const String &url); // begin() di atas koneksi keep-alive
+void dropGScriptConnection(GScriptConnection &connection);                  // Tutup socket setelah error
 
 // =========================
 // ======= RFID DECLARATIONS =======
@@ -232,15 +1219,43 @@ bool handleHttpResponse(int httpCode, const String &response); // Handle HTTP re
 // Basic RFID Functions
 void initRFID();   // Inisialisasi modul RFID
 void handleRFID(); // Handler utama RFID untuk loop()
+void rfidTask(void *parameter);      // Task pembaca kartu di RFID_TASK_CORE
+bool rfidScanBlocked();              // Scan sedang tidak diterima?
+#if RFID_USE_IRQ
+void IRAM_ATTR rfidIrqHandler();     // ISR pin IRQ: bangunkan task RFID
+bool waitForCardIRQ();               // Kirim REQA lalu tunggu IRQ jawaban kartu
+#endif
+void setRFIDEnabled(bool enabled);   // Minta task RFID menyalakan/mematikan antena
+void drainScanQueue();               // Pindahkan hasil scan dari antrian ke journal
+uint32_t pendingScanCount();         // Jumlah scan di antrian + journal
 
 // RFID Reading Functions
 void processRFIDCard();               // Memproses kartu yang terdeteksi
-String readRFIDBlock(byte blockAddr); // Membaca data dari blok spesifik
+bool readRFIDBlock(byte blockAddr);   // Membaca blok yang sudah diautentikasi ke readBlockData
+void buildCardReadPlan();             // Susun langkah baca dari CARD_LAYOUT
+void beginReadStep();                 // Mulai langkah cardReadPlan berikutnya
+void decodeCardField(const CardField &field, const byte *blockData, char *out, size_t outSize);
+void reportCardReadStats();           // Tampilkan waktu baca per field ke Serial
+uint32_t hashUID(const byte *uid, byte uidLength); // FNV-1a dari UID mentah
+bool isDuplicateScan(uint32_t uidHash);           // Kartu sama dalam DUPLICATE_SCAN_WINDOW?
+void rememberScan(uint32_t uidHash);              // Catat kartu yang baru diterima
+void setScanState(ScanState state);   // Pindah tahap state machine scan
+void failScan();                      // Feedback & penutupan sesi saat baca gagal
+void handleCriticalRFIDFailure();     // Kirim journal lalu restart
+void recoverRFIDReader();             // Jalankan tier pemulihan berikutnya
+bool rfidReaderResponding();          // Cek VersionReg MFRC522
 
 // Buffer Management Functions
-bool addToBuffer(const RFIDData &data); // Menambahkan data ke buffer
-String prepareDataForBatch();           // Menyiapkan data untuk pengiriman batch
-String cleanString(const String &str);
+bool addToBuffer(const RFIDData &data); // Menambahkan data ke journal
+void commitUploadBatch(const UploadBatch &batch);      // Hapus batch dari journal setelah terkirim
+size_t appendJsonField(char *out, const char *value);  // Tulis string JSON ter-escape, return panjang
+size_t renderBatchRow(const RFIDData &data, const ClockSnapshot &clock, bool first, char *out); // Satu baris [NISN, NIP, Nama]
+size_t appendCsvField(char *out, const char *value);   // Tulis field CSV (RFC 4180), return panjang
+size_t renderBatchRowCsv(const RFIDData &data, const ClockSnapshot &clock, char *out); // Satu baris "NISN,NIP,Nama\n"
+#ifdef BATCH_FORMAT_BENCHMARK
+void benchmarkBatchFormats();                          // Cetak perbandingan format batch ke Serial
+#endif
+void formatUID(const RFIDData &data, char *out, size_t outSize); // UID dalam hex untuk log
 
 // Helper Functions
 bool isBufferFull();  // Mengecek apakah buffer penuh
@@ -249,24 +1264,54 @@ void clearBuffer();   // Membersihkan buffer
 
 // Status and Debug Functions
 void printBufferStatus(); // Menampilkan status buffer ke Serial
+void reportHeapUsage();   // Laporan free heap, low-water mark, fragmentasi & trafik OLED
 void updateRFIDStatus();  // Update status RFID ke OLED/LED
 
 // Error Handling Functions
 bool validateRFIDData(const RFIDData &data); // Validasi data RFID
 void handleRFIDError(const String &error);   // Penanganan error RFID
 
+void initRFIDOnSharedBus(bool hardReset); // PCD_Init() tanpa merusak bus I2C OLED
 void resetRFIDModule();
 
-// Constants and Configuration
-constexpr byte RFID_BLOCKS[] = {4, 5, 6};
-constexpr byte TOTAL_BLOCKS = sizeof(RFID_BLOCKS) / sizeof(RFID_BLOCKS[0]);
+// =========================
+// ======= JOURNAL DECLARATIONS =======
+// =========================
+
+bool initJournal();                                                  // Mount LittleFS & pulihkan cursor
+bool journalAppend(const RFIDData &data);                            // Tambah record di tail
+int journalPeek(const JournalCursor &from, RFIDData *out, int maxRecords, JournalCursor &next); // Baca tanpa menghapus (out boleh nullptr)
+void journalCommit(const JournalCursor &next, int count);            // Majukan head & simpan cursor
+bool journalIsFull();                                                // Cek kapasitas segmen
+uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t length); // CRC-32 bertahap (journal & gzip)
+uint32_t journalCrc32(const uint8_t *data, size_t length);
+
+// =========================
+// ======= UID CACHE DECLARATIONS =======
+// =========================
+
+bool initUIDCache();                                                                     // Muat cache dari flash
+bool uidCacheLookup(const byte *uid, byte uidLength, RFIDData &record, bool &revalidate); // Isi blockData dari cache
+bool uidCacheStore(const byte *uid, byte uidLength, const RFIDData &record);           // Simpan/perbarui identitas
+void flushUIDCache();                                                                    // Tulis slot berubah ke flash
+
+// =========================
+// ======= CLOCK DECLARATIONS =======
+// =========================
+
+void initClock();                                  // Pulihkan jam dari RTC & mulai SNTP
+void onTimeSync(struct timeval *tv);               // Callback SNTP: perbarui pemetaan
+uint32_t clockNowUtc();                            // Detik UTC sekarang, 0 = belum diketahui
+void stampCaptureTime(RFIDData &data);             // Isi timestamp, captureTime & bootId saat scan
+ClockSnapshot clockSnapshot();                     // Salin pemetaan jam saat ini
+uint32_t resolveCaptureTime(const RFIDData &data, const ClockSnapshot &clock); // Waktu scan UTC untuk payload, 0 = tidak diketahui
 
 // External Variables Declaration
 extern MFRC522 mfrc522;
 extern MFRC522::MIFARE_Key key;
-extern RFIDBuffer rfidBuffer;
-extern bool isProcessing;
-extern unsigned long lastSuccessfulRead;
+extern AttendanceJournal journal;
+extern volatile bool isProcessing;
+extern RecentUIDTable recentUIDs;
 
 // =========================
 // ======= DEKLARASI FUNGSI =======
@@ -275,9 +1320,18 @@ extern unsigned long lastSuccessfulRead;
 // Manajemen OLED
 void initOLED();
 void clearOLED();
+void flushOLED(); // Kirim hanya bagian frame yang berubah ke panel
+void initDisplayTask();
+void displayTask(void *parameter);                 // Render pesan display dengan frame rate terbatas
+void postDisplay(const DisplayMessage &message);   // Tanpa blocking, menimpa pesan yang belum dirender
+void renderDisplayMessage(const DisplayMessage &message);
+void postOLEDStatus(const char *primaryText, const char *secondaryText = ""); // Versi tanpa String untuk jalur scan
 void updateOLEDStatus(const String &primaryText, const String &secondaryText = "", bool showDefaultDisplay = false);
 void showDefaultOLEDDisplay();
+bool scanFeedbackShowing(); // Hasil scan terakhir belum boleh ditimpa layar idle
 void showErrorOLED(const String &errorMsg);
+void showAPInfoOLED();
+void showConnectedOLED(const String &ssid, const String &ip);
 
 // Setup dan Inisialisasi Wifi
 void initWiFi();
@@ -292,8 +1346,11 @@ bool testWiFiConnection();
 // Handle connection wifi
 void handleConnectionFailure();
 void showConnectionProgress(int attempt, int maxAttempts);
-void handleForget();
+void handleForget(AsyncWebServerRequest *request);
 void checkAndUpdateWiFiStatus();
+void checkWiFiConnection();       // Reconnect tanpa blocking; scan tetap jalan saat offline
+void startOfflinePortal();        // Soft-AP portal di samping STA selama offline
+void stopOfflinePortal();
 
 // Manajemen EEPROM
 String readEEPROM(int startAddr, int maxLength);
@@ -302,12 +1359,16 @@ void loadWiFiCredentials();
 void saveWiFiCredentials(const String &ssid, const String &password);
 void resetWiFiCredentials();
 
-// Handler Web Server
-void handleRoot();
-void handleWiFiScan();
-void handleConnect();
-void handleStatus();
-void handleReset();
+// Handler Web Server (task async_tcp, tanpa blocking)
+const WebAsset *findWebAsset(const char *path);
+void serveWebAsset(AsyncWebServerRequest *request, const WebAsset &asset); // gzip dari flash + ETag/304
+void appendJsonString(String &json, const String &value);
+void handleWiFiNetworks(AsyncWebServerRequest *request); // Hasil scan WiFi untuk halaman /scan
+void handleConnect(AsyncWebServerRequest *request);
+void handleStatus(AsyncWebServerRequest *request);
+void handleReset(AsyncWebServerRequest *request);
+void handlePortalActions();  // Jalankan aksi portal yang blocking dari loop()
+void applyPortalConnect();
 
 // Manajemen LED
 void initLEDs();
@@ -321,6 +1382,14 @@ void beep(uint8_t times, uint16_t durationMs);
 void errorBeep();
 void successBeep();
 
+// Pola LED & buzzer non-blocking
+void initFeedback();
+void feedbackTick(void *arg);          // Callback esp_timer setiap FEEDBACK_TICK_MS
+void startFeedbackCue(const FeedbackCue &cue, FeedbackPriority priority, bool loop, FeedbackKind kind);
+void playFeedback(FeedbackKind kind);  // Langsung kembali, dimainkan di background
+void stopFeedback(FeedbackKind kind);
+void setLEDLevel(uint8_t pin, bool level); // Level dasar LED, dipulihkan setelah setiap pola
+
 // =========================
 // ======= OTA FUNCTIONS =======
 // =========================
@@ -329,7 +1398,7 @@ void checkFirmwareUpdate() {
     if (WiFi.status() != WL_CONNECTED) return;
 
     updateOLEDStatus("Checking Update", "Please wait...");
-    digitalWrite(LED_YELLOW, HIGH);
+    setLEDLevel(LED_YELLOW, HIGH);
 
     HTTPClient http;
     versionCheckFailed = false;
@@ -374,7 +1443,7 @@ void checkFirmwareUpdate() {
         updateOLEDStatus("Connection Failed", "Can't reach server");
     }
     
-    digitalWrite(LED_YELLOW, LOW);
+    setLEDLevel(LED_YELLOW, LOW);
 }
 
 void performUpdate(Stream &updateSource, size_t updateSize) {
@@ -404,7 +1473,7 @@ void performUpdate(Stream &updateSource, size_t updateSize) {
 void updateFirmware() {
     isOTAInProgress = true;
     updateOLEDStatus("OTA Update", "Downloading...");
-    digitalWrite(LED_YELLOW, HIGH);
+    setLEDLevel(LED_YELLOW, HIGH);
 
     HTTPClient http;
     
@@ -420,7 +1489,7 @@ void updateFirmware() {
             updateOLEDStatus("OTA Failed", "Download error: " + String(httpCode));
             Serial.println("Download failed. Code: " + String(httpCode));
             isOTAInProgress = false;
-            digitalWrite(LED_YELLOW, LOW);
+            setLEDLevel(LED_YELLOW, LOW);
             return;
         }
 
@@ -428,7 +1497,7 @@ void updateFirmware() {
             updateOLEDStatus("OTA Failed", "File not found");
             Serial.println("File not found. Code: " + String(httpCode));
             isOTAInProgress = false;
-            digitalWrite(LED_YELLOW, LOW);
+            setLEDLevel(LED_YELLOW, LOW);
             return;
         }
 
@@ -439,7 +1508,7 @@ void updateFirmware() {
             updateOLEDStatus("OTA Failed", "Invalid size");
             Serial.println("Invalid content length: " + String(contentLength));
             isOTAInProgress = false;
-            digitalWrite(LED_YELLOW, LOW);
+            setLEDLevel(LED_YELLOW, LOW);
             return;
         }
 
@@ -498,169 +1567,53 @@ void updateFirmware() {
     Serial.println("Update failed");
     http.end();
     isOTAInProgress = false;
-    digitalWrite(LED_YELLOW, LOW);
+    setLEDLevel(LED_YELLOW, LOW);
 }
 
 // =========================
 // ======= OTA HANDLERS =======
 // =========================
 
-void handleOTAUpdate() {
-    if (!server.authenticate(OTA_USERNAME, OTA_PASSWORD)) {
-        return server.requestAuthentication();
-    }
-
-    String html = R"(
-    <!DOCTYPE html>
-    <html>
-    <head>
-        <meta name='viewport' content='width=device-width, initial-scale=1.0'>
-        <title>OTA Update</title>
-        <style>
-            body { font-family: Arial; margin: 0; padding: 20px; background: #f0f0f0; }
-            .container { max-width: 500px; margin: 0 auto; background: white; padding: 20px; border-radius: 8px; box-shadow: 0 2px 4px rgba(0,0,0,0.1); }
-            .info-box { background: #e3f2fd; padding: 15px; border-radius: 4px; margin: 10px 0; }
-            .update-box { background: #f1f8e9; padding: 15px; border-radius: 4px; margin: 10px 0; }
-            .error-box { background: #ffebee; padding: 15px; border-radius: 4px; margin: 10px 0; }
-            .warning { color: #856404; background: #fff3cd; padding: 15px; border-radius: 4px; margin: 10px 0; }
-            .btn { background: #007bff; color: white; padding: 10px 20px; border: none; border-radius: 4px; cursor: pointer; }
-            .btn:hover { background: #0056b3; }
-            .btn-danger { background: #dc3545; }
-            .btn-danger:hover { background: #c82333; }
-            .loading { display: none; text-align: center; padding: 20px; }
-            .spinner { border: 4px solid #f3f3f3; border-top: 4px solid #3498db; border-radius: 50%; width: 40px; height: 40px; animation: spin 1s linear infinite; margin: 10px auto; }
-            @keyframes spin { 0% { transform: rotate(0deg); } 100% { transform: rotate(360deg); } }
-        </style>
-    </head>
-    <body>
-        <div class='container'>
-            <h1>Firmware Update</h1>
-            
-            <div class='info-box'>
-                <h3>Current Version</h3>
-                <p>Installed: )";
-    
-    html += CURRENT_VERSION;
-    html += R"(</p>
-                <p>Latest Available: )";
-    
-    // Tampilkan status yang sesuai berdasarkan hasil pengecekan
-    if (versionCheckFailed) {
-        html += "<span style='color: #d32f2f;'>Gagal mengambil versi dari server</span>";
-    } else {
-        html += latestVersion.isEmpty() ? "Belum dilakukan pengecekan" : latestVersion;
-    }
-    
-    html += R"(</p>
-            </div>
-            
-            <div class=')";
-    
-    // Pilih class box yang sesuai berdasarkan status
-    if (versionCheckFailed) {
-        html += "error-box";
-    } else {
-        html += "update-box";
+void handleOTAUpdate(AsyncWebServerRequest *request) {
+    if (!request->authenticate(OTA_USERNAME, OTA_PASSWORD)) {
+        return request->requestAuthentication();
     }
-    
-    html += R"('>
-                <h3>Update Status</h3>
-                <p id='updateStatus'>)";
-    
-    // Tampilkan pesan status yang sesuai
-    if (versionCheckFailed) {
-        html += "Tidak dapat memeriksa pembaruan. Silakan coba lagi.";
-    } else if (updateAvailable) {
-        html += "Pembaruan tersedia!";
-    } else if (!latestVersion.isEmpty()) {
-        html += "Sistem sudah menggunakan versi terbaru";
-    } else {
-        html += "Silakan periksa pembaruan";
-    }
-    
-    html += R"(</p>
-            </div>
-
-            <div class='warning'>
-                <strong>Peringatan:</strong> Jangan matikan perangkat atau putuskan koneksi selama proses pembaruan berlangsung.
-            </div>
-
-            <div class='loading' id='loadingSection'>
-                <div class='spinner'></div>
-                <p>Sedang memproses...</p>
-            </div>
 
-            <div style='text-align: center; margin-top: 20px;'>
-                <button onclick='checkUpdate()' class='btn'>Periksa Pembaruan</button>
-                )";
-    
-    if (updateAvailable) {
-        html += R"(<button onclick='startUpdate()' class='btn btn-danger'>Pasang Pembaruan</button>)";
+    const WebAsset *asset = findWebAsset("/ota");
+    if (!asset) {
+        request->send(404);
+        return;
     }
-    
-    html += R"(
-                <button onclick='location.href="/"' class='btn'>Kembali ke Menu Utama</button>
-            </div>
-        </div>
-
-        <script>
-            function showLoading() {
-                document.getElementById('loadingSection').style.display = 'block';
-            }
-            
-            function hideLoading() {
-                document.getElementById('loadingSection').style.display = 'none';
-            }
-
-            function checkUpdate() {
-                showLoading();
-                fetch('/check-update')
-                    .then(response => response.json())
-                    .then(data => {
-                        hideLoading();
-                        document.getElementById('updateStatus').textContent = data.message;
-                        if (data.updateAvailable || data.error) {
-                            location.reload();
-                        }
-                    })
-                    .catch(error => {
-                        hideLoading();
-                        alert('Error saat memeriksa pembaruan: ' + error);
-                    });
-            }
+    serveWebAsset(request, *asset);
+}
 
-            function startUpdate() {
-                if (confirm('Anda yakin ingin memperbarui firmware? Perangkat akan restart setelah pembaruan selesai.')) {
-                    showLoading();
-                    fetch('/start-update', { method: 'POST' })
-                        .then(response => response.text())
-                        .then(data => {
-                            alert(data);
-                            if (data.includes('started')) {
-                                setTimeout(() => {
-                                    location.reload();
-                                }, 30000);
-                            } else {
-                                hideLoading();
-                            }
-                        })
-                        .catch(error => {
-                            hideLoading();
-                            alert('Error saat memulai pembaruan: ' + error);
-                        });
-                }
-            }
-        </script>
-    </body>
-    </html>
-    )";
+void handleFirmwareInfo(AsyncWebServerRequest *request) {
+    if (!request->authenticate(OTA_USERNAME, OTA_PASSWORD)) {
+        return request->requestAuthentication();
+    }
 
-    server.send(200, "text/html", html);
+    // latestVersion sedang ditulis loop() selama pengecekan berjalan
+    bool checking = portalActions.load() & PORTAL_CHECK_UPDATE;
+    String json = "{\"current\":";
+    appendJsonString(json, CURRENT_VERSION);
+    json += ",\"latest\":";
+    appendJsonString(json, checking ? String("") : latestVersion);
+    json += ",\"checkFailed\":" + String(versionCheckFailed ? "true" : "false");
+    json += ",\"updateAvailable\":" + String(updateAvailable ? "true" : "false") + "}";
+    request->send(200, "application/json", json);
 }
 
-void handleCheckUpdate() {
-    checkFirmwareUpdate();
-    
+void handleCheckUpdate(AsyncWebServerRequest *request) {
+    // Cek versi butuh request HTTPS, jadi dijalankan loop(); browser
+    // mengulang dengan ?poll=1 sampai hasilnya siap
+    if (!request->hasArg("poll")) {
+        portalActions.fetch_or(PORTAL_CHECK_UPDATE);
+    }
+    if (portalActions.load() & PORTAL_CHECK_UPDATE) {
+        request->send(200, "application/json", "{\"checking\":true}");
+        return;
+    }
+
     String response;
     if (versionCheckFailed) {
         response = "{\"error\":true,\"message\":\"Gagal mengambil versi dari server\"}";
@@ -675,22 +1628,22 @@ void handleCheckUpdate() {
         response += "}";
     }
     
-    server.send(200, "application/json", response);
+    request->send(200, "application/json", response);
 }
 
-void handleStartUpdate() {
-    if (!server.authenticate("admin", "admin123")) {
-        return server.requestAuthentication();
+void handleStartUpdate(AsyncWebServerRequest *request) {
+    if (!request->authenticate("admin", "admin123")) {
+        return request->requestAuthentication();
     }
 
     if (!updateAvailable) {
-        server.send(400, "text/plain", "No update available");
+        request->send(400, "text/plain", "No update available");
         return;
     }
 
-    server.send(200, "text/plain", "Update process started");
-    delay(1000);
-    updateFirmware();
+    // Unduhan berjalan di loop(); server tetap melayani /status selama OTA
+    portalActions.fetch_or(PORTAL_START_UPDATE);
+    request->send(200, "text/plain", "Update process started");
 }
 
 // =========================
@@ -700,41 +1653,28 @@ void handleStartUpdate() {
 bool initGoogleApps()
 {
     updateOLEDStatus("Checking GScript", "Connecting...");
-    digitalWrite(LED_YELLOW, HIGH);
+    setLEDLevel(LED_YELLOW, HIGH);
 
-    bool connected = false;
-    int retries = 0;
+    // Satu percobaan saja: retry berikutnya dijadwalkan retry policy dan
+    // dijalankan task upload tanpa menahan setup()
+    bool connected = testGoogleScriptConnection();
 
-    while (!connected && retries < MAX_RETRIES)
+    if (connected)
     {
-        if (testGoogleScriptConnection())
-        {
-            connected = true;
-            isGScriptConnected = true;
-            updateOLEDStatus("GScript Ready", "Connected!");
-            blinkLED(LED_GREEN, 2, 200);
-            beep(1, 200); // Success beep
-            digitalWrite(LED_YELLOW, LOW);
-            Serial.println("Google Apps Script connected successfully");
-            break;
-        }
-
-        retries++;
-        if (retries < MAX_RETRIES)
-        {
-            String retryMsg = "Retry " + String(retries) + "/" + String(MAX_RETRIES);
-            updateOLEDStatus("Connection Failed", retryMsg);
-            blinkLED(LED_RED, 2, 200);
-            beep(2, 100); // Error beep
-            delay(RETRY_DELAY);
-        }
+        recordGScriptSuccess();
+        isGScriptConnected = true;
+        updateOLEDStatus("GScript Ready", "Connected!");
+        blinkLED(LED_GREEN, 2, 200);
+        beep(1, 200); // Success beep
+        setLEDLevel(LED_YELLOW, LOW);
+        Serial.println("Google Apps Script connected successfully");
     }
-
-    if (!connected)
+    else
     {
-        updateOLEDStatus("GScript Failed", "Check connection");
-        digitalWrite(LED_RED, HIGH);
-        digitalWrite(LED_YELLOW, LOW);
+        recordGScriptFailure();
+        updateOLEDStatus("GScript Offline", "Scan tetap disimpan");
+        setLEDLevel(LED_RED, HIGH);
+        setLEDLevel(LED_YELLOW, LOW);
         beep(3, 200); // Critical error beep
         Serial.println("Failed to connect to Google Apps Script");
     }
@@ -756,723 +1696,2774 @@ String getRedirectUrl(const String &response)
     return "";
 }
 
+// Siapkan request di atas koneksi yang masih terbuka. Jika socket sudah
+// putus (atau host berubah), handshake TLS dilakukan di sini agar durasinya
+// bisa diukur; HTTPClient lalu memakai socket yang sudah terhubung.
+bool beginGScriptRequest(GScriptConnection &connection, const String &url)
+{
+    if (!connection.configured)
+    {
+        connection.client.setInsecure(); // Skip certificate verification
+        connection.http.setReuse(true);
+        connection.http.setTimeout(HTTP_TIMEOUT);
+        connection.configured = true;
+    }
+
+    int hostStart = url.indexOf("://") + 3;
+    int hostEnd = url.indexOf('/', hostStart);
+    String host = url.substring(hostStart, hostEnd < 0 ? url.length() : hostEnd);
+
+    if (host != connection.host)
+    {
+        connection.client.stop();
+        connection.host = host;
+    }
+
+    if (connection.client.connected())
+    {
+        connection.reuses++;
+    }
+    else
+    {
+        unsigned long start = millis();
+        bool connected = connection.client.connect(host.c_str(), GScriptHttpsPort);
+        connection.lastHandshakeMs = millis() - start;
+
+        if (!connected)
+        {
+            connection.handshakeFailures++;
+            Serial.printf("TLS connect to %s failed after %lu ms\n", host.c_str(), (unsigned long)connection.lastHandshakeMs);
+            return false;
+        }
+        connection.handshakes++;
+        connection.totalHandshakeMs += connection.lastHandshakeMs;
+        Serial.printf("TLS handshake %s: %lu ms\n", host.c_str(), (unsigned long)connection.lastHandshakeMs);
+    }
+
+    return connection.http.begin(connection.client, url);
+}
+
+void dropGScriptConnection(GScriptConnection &connection)
+{
+    connection.http.end();
+    connection.client.stop();
+}
+
 bool testGoogleScriptConnection()
 {
-    // Create secure WiFi client
-    WiFiClientSecure client;
-    client.setInsecure(); // Skip certificate verification
+    HTTPClient &https = scriptConnection.http;
+    HTTPClient &redirect = redirectConnection.http;
 
     // Initial URL
     String initialUrl = "https://script.google.com/macros/s/" + String(GScriptId) + "/exec";
     Serial.println("Initial URL: " + initialUrl);
 
-    // Create HTTP client
-    HTTPClient https;
+    if (!beginGScriptRequest(scriptConnection, initialUrl))
+    {
+        Serial.println("HTTPS connection failed");
+        return false;
+    }
 
-    if (https.begin(client, initialUrl))
+    https.addHeader("Content-Type", "application/json");
+    https.addHeader("Accept", "application/json");
+    String payload = "{\"command\":\"test_connection\",\"formats\":\"csv1\",\"encodings\":\"gzip\"}";
+
+    int httpCode = https.POST(payload);
+    Serial.println("First request response code: " + String(httpCode));
+
+    if (httpCode != 302)
     {
-        https.addHeader("Content-Type", "application/json");
-        https.addHeader("Accept", "application/json");
-        String payload = "{\"command\":\"test_connection\"}";
+        Serial.println("Unexpected response on first request");
+        if (httpCode < 0)
+        {
+            dropGScriptConnection(scriptConnection);
+            return false;
+        }
+        Serial.println("Response: " + https.getString());
+        https.end();
+        return false;
+    }
 
-        int httpCode = https.POST(payload);
-        Serial.println("First request response code: " + String(httpCode));
+    // Handle redirect; body dibaca habis agar koneksi bisa dipakai ulang
+    String response = https.getString();
+    String redirectUrl = getRedirectUrl(response);
+    https.end();
 
-        if (httpCode == 302)
-        { // Handle redirect
-            String response = https.getString();
-            String redirectUrl = getRedirectUrl(response);
-            https.end();
+    Serial.println("Redirect URL found: " + redirectUrl);
 
-            Serial.println("Redirect URL found: " + redirectUrl);
+    if (!beginGScriptRequest(redirectConnection, redirectUrl))
+    {
+        return false;
+    }
 
-            if (https.begin(client, redirectUrl))
-            {
-                // Modified headers for second request
-                https.addHeader("Content-Type", "application/json");
-                https.addHeader("Accept", "application/json");
-                https.addHeader("User-Agent", "Mozilla/5.0");
-                https.addHeader("x-requested-with", "XMLHttpRequest");
+    // Modified headers for second request
+    redirect.addHeader("Content-Type", "application/json");
+    redirect.addHeader("Accept", "application/json");
+    redirect.addHeader("User-Agent", "Mozilla/5.0");
+    redirect.addHeader("x-requested-with", "XMLHttpRequest");
 
-                // Try GET instead of POST for the redirect
-                httpCode = https.GET();
-                Serial.println("Second request response code: " + String(httpCode));
+    // Try GET instead of POST for the redirect
+    httpCode = redirect.GET();
+    Serial.println("Second request response code: " + String(httpCode));
 
-                if (httpCode == 200)
-                {
-                    String finalResponse = https.getString();
-                    Serial.println("Final Response: " + finalResponse);
-
-                    if (finalResponse == "Success")
-                    {
-                        Serial.print("Response: ");
-                        Serial.println(finalResponse);
-                        return true;
-                    }
-                    else
-                    {
-                        Serial.println("Connection test failed - unexpected response");
-                        return false;
-                    }
-                }
-                else
-                {
-                    Serial.println("Error on second request");
-                    Serial.println("Response: " + https.getString());
-                    return false;
-                }
-            }
-        }
-        else
-        {
-            Serial.println("Unexpected response on first request");
-            Serial.println("Response: " + https.getString());
-        }
+    if (httpCode < 0)
+    {
+        Serial.println("Error on second request");
+        dropGScriptConnection(redirectConnection);
+        return false;
+    }
 
-        https.end();
-    } else {
-        Serial.println("HTTPS connection failed");
+    String finalResponse = redirect.getString();
+    redirect.end();
+
+    if (httpCode != 200)
+    {
+        Serial.println("Error on second request");
+        Serial.println("Response: " + finalResponse);
         return false;
     }
 
+    Serial.println("Final Response: " + finalResponse);
+    if (finalResponse == "Success" || finalResponse.startsWith("Success "))
+    {
+        // Endpoint yang mendukung CSV/gzip menambahkan namanya di jawaban
+        gscriptBatchFormat = finalResponse.indexOf("csv1") > 0 ? BATCH_FORMAT_CSV : BATCH_FORMAT_JSON;
+        gscriptBatchGzip = finalResponse.indexOf("gzip") > 0;
+        Serial.print("Response: ");
+        Serial.println(finalResponse);
+        Serial.println("Batch format: " + String(BATCH_FORMAT_NAMES[gscriptBatchFormat]) + (gscriptBatchGzip ? " + gzip" : ""));
+        return true;
+    }
+
+    Serial.println("Connection test failed - unexpected response");
     return false;
 }
 
-bool sendBatchToGScript(const String &batchData) {
-    if (!isGScriptConnected || batchData.isEmpty()) {
+bool sendBatchToGScript(const UploadBatch &batch) {
+    if (!isGScriptConnected || batch.count == 0) {
         return false;
     }
 
+    // Saat menguras backlog layar tetap menampilkan antrian & scan terbaru
+    bool quiet = backlogDraining();
     isSending = true;
-    updateOLEDStatus("Sending Data", "Please wait...");
-    digitalWrite(LED_YELLOW, HIGH);
+    if (!quiet) {
+        updateOLEDStatus("Sending Data", "Please wait...");
+    }
 
-    WiFiClientSecure client;
-    client.setInsecure();
-    HTTPClient https;
+    HTTPClient &https = scriptConnection.http;
+    HTTPClient &redirect = redirectConnection.http;
 
-    // Format payload
-    String payload = "{\"command\":\"insert_rows\",\"sheet_name\":\"LOG_Attendance\",\"values\":" + batchData + "}";
-    Serial.println("Sending payload: " + payload);
+    // Payload di-stream dari journal, tidak pernah dirakit utuh di RAM
+    BatchFormat format = gscriptBatchFormat;
+    bool gzip = gscriptBatchGzip;
+    size_t payloadLength = batchStream.begin(batch, format, gzip);
+    Serial.printf("Sending batch: %d records, %u bytes (%s%s, %u raw)\n", batch.count, (unsigned)payloadLength,
+                  BATCH_FORMAT_NAMES[format], gzip ? "+gzip" : "", (unsigned)batchStream.rawLength());
 
-    // Initial URL
+    // Initial URL; untuk CSV perintah dan sheet dikirim sebagai parameter URL
     String initialUrl = "https://script.google.com/macros/s/" + String(GScriptId) + "/exec";
+    if (format == BATCH_FORMAT_CSV) {
+        initialUrl += "?command=insert_rows_csv&sheet_name=LOG_Attendance&device=" + String(deviceId()) +
+                      "&batch_id=" + String(batchStream.idempotencyKey());
+    }
+    if (gzip) {
+        initialUrl += format == BATCH_FORMAT_CSV ? "&encoding=gzip" : "?encoding=gzip";
+    }
     Serial.println("Initial URL: " + initialUrl);
+    Serial.println("Batch id: " + String(batchStream.idempotencyKey()));
 
     bool success = false;
-    int retries = 0;
 
-    while (!success && retries < MAX_RETRIES) {
-        if (https.begin(client, initialUrl)) {
+    // Satu percobaan per panggilan; jeda & retry diatur retry policy di
+    // task upload. Pengecualian: socket keep-alive yang ternyata sudah
+    // ditutup server langsung dicoba sekali lagi dengan koneksi baru.
+    for (int attempt = 0; attempt < 2 && !success; attempt++) {
+        uint32_t reusesBefore = scriptConnection.reuses;
+        bool staleSocket = false;
+
+        if (beginGScriptRequest(scriptConnection, initialUrl)) {
             // Headers for initial request
-            https.addHeader("Content-Type", "application/json");
+            https.addHeader("Content-Type", format == BATCH_FORMAT_CSV ? "text/csv" : "application/json");
             https.addHeader("Accept", "application/json");
+            if (gzip) {
+                https.addHeader("Content-Encoding", "gzip");
+            }
 
-            int httpCode = https.POST(payload);
+            batchStream.rewind();
+            int httpCode = https.sendRequest("POST", &batchStream, payloadLength);
             Serial.println("First request response code: " + String(httpCode));
 
-            if (httpCode == 302) {
+            // Dihitung sekali per batch yang sampai ke server, bukan per
+            // percobaan, agar rasio raw/wire tidak ikut retry socket basi
+            if (httpCode >= 0) {
+                uploader.rawBytes += batchStream.rawLength();
+                uploader.wireBytes += payloadLength;
+            }
+
+            if (httpCode < 0) {
+                // Socket keep-alive mungkin sudah ditutup server: retry dengan koneksi baru
+                dropGScriptConnection(scriptConnection);
+                staleSocket = scriptConnection.reuses != reusesBefore;
+            } else if (httpCode == 302) {
                 String response = https.getString();
                 String redirectUrl = getRedirectUrl(response);
                 https.end();
 
                 Serial.println("Redirect URL found: " + redirectUrl);
 
-                if (https.begin(client, redirectUrl)) {
+                if (beginGScriptRequest(redirectConnection, redirectUrl)) {
                     // Modified headers for redirect request
-                    https.addHeader("Content-Type", "application/json");
-                    https.addHeader("Accept", "application/json");
-                    https.addHeader("User-Agent", "Mozilla/5.0");
-                    https.addHeader("x-requested-with", "XMLHttpRequest");
+                    redirect.addHeader("Content-Type", "application/json");
+                    redirect.addHeader("Accept", "application/json");
+                    redirect.addHeader("User-Agent", "Mozilla/5.0");
+                    redirect.addHeader("x-requested-with", "XMLHttpRequest");
 
                     // Use GET for the redirect request
-                    httpCode = https.GET();
+                    httpCode = redirect.GET();
                     Serial.println("Second request response code: " + String(httpCode));
 
-                    if (httpCode == 200) {
-                        String finalResponse = https.getString();
-                        Serial.println("Final Response: " + finalResponse);
+                    if (httpCode < 0) {
+                        dropGScriptConnection(redirectConnection);
+                    } else {
+                        // Body selalu dibaca habis agar socket tetap bisa dipakai ulang
+                        batchAck.reset();
+                        redirect.writeToStream(&batchAck);
+                        redirect.end();
 
-                        if (finalResponse.startsWith("Success")) {
+                        if (httpCode == 200 && batchAck.valid()) {
                             success = true;
-                            String insertCount = finalResponse.substring(finalResponse.lastIndexOf(" "));
-                            updateOLEDStatus("Data Sent", insertCount + " rows");
-                            blinkLED(LED_GREEN, 2, 200);
-                            beep(1, 200);
-                            
-                            // Reset buffer state after successful send
-                            rfidBuffer.head = 0;
-                            rfidBuffer.tail = 0;
-                            rfidBuffer.count = 0;
+                            Serial.printf("Ack (%s): %lu accepted, %lu rejected\n", batchAck.legacy() ? "text" : "json",
+                                          (unsigned long)batchAck.acceptedRows(), (unsigned long)batchAck.rejectedRows());
+                            if (!quiet) {
+                                updateOLEDStatus("Data Sent", String(batchAck.acceptedRows()) + " rows");
+                                blinkLED(LED_GREEN, 2, 200);
+                                beep(1, 200);
+                            }
                         }
                     }
                 }
+            } else {
+                // Body dibaca habis agar socket tetap bisa dipakai ulang
+                https.getString();
+                https.end();
             }
-            https.end();
         }
 
-        if (!success) {
-            retries++;
-            if (retries < MAX_RETRIES) {
-                String retryMsg = "Retry " + String(retries) + "/" + String(MAX_RETRIES);
-                updateOLEDStatus("Send Failed", retryMsg);
-                blinkLED(LED_RED, 1, 200);
-                beep(2, 100);
-                delay(RETRY_DELAY);
-            }
+        if (!staleSocket) {
+            break;
         }
     }
 
-    digitalWrite(LED_YELLOW, LOW);
     isSending = false;
 
-    if (!success) {
-        updateOLEDStatus("Send Failed", "server error, hubungi IT");
-        blinkLED(LED_RED, 3, 200);
-        beep(3, 200);
-    }
-
     return success;
 }
 
 void checkGScriptConnection()
 {
-    if (millis() - lastConnectionCheck >= CONNECTION_CHECK_INTERVAL)
+    // Terhubung: upload yang berhasil sudah membuktikan koneksi sehat, probe
+    // hanya setelah idle. Terputus: probe segera setelah jeda retry habis
+    // (half-open bila circuit open). Scan tetap masuk journal.
+    bool wasConnected = isGScriptConnected;
+    if (wasConnected && gscriptHealth.lastSuccess != 0 &&
+        millis() - gscriptHealth.lastSuccess < GSCRIPT_IDLE_PROBE_INTERVAL)
     {
-        lastConnectionCheck = millis();
-
-        // Block RFID terlebih dahulu
-        mfrc522.PCD_AntennaOff();
-        isProcessing = true;  // Prevent RFID processing
-
-        // Feedback visual
-        digitalWrite(LED_YELLOW, HIGH);
-        digitalWrite(LED_GREEN, LOW);
-        beep(1, 100);
+        return;
+    }
+    if (!gscriptCallAllowed())
+    {
+        return;
+    }
 
-        // Update OLED
-        updateOLEDStatus("Checking GScript", "Connecting...");
+    if (wasConnected)
+    {
+        gscriptHealth.idleProbes++;
+    }
 
-        // Cek apakah ada data di buffer sebelum melakukan pengecekan
-        if (rfidBuffer.count > 0) {
-            updateOLEDStatus("Buffer Not Empty", "Sending data first...");
-            
-            // Coba kirim data buffer terlebih dahulu
-            String batchData = prepareDataForBatch();
-            if (!batchData.isEmpty()) {
-                if (sendBatchToGScript(batchData)) {
-                    updateOLEDStatus("Buffer Sent", "Checking connection...");
-                    successBeep();
-                    blinkLED(LED_GREEN, 2, 200);
-                } else {
-                    updateOLEDStatus("Send Failed", "Checking connection...");
-                    errorBeep();
-                    blinkLED(LED_RED, 2, 200);
-                }
-            }
-            delay(1000); // Berikan waktu untuk membaca pesan
+    if (testGoogleScriptConnection())
+    {
+        recordGScriptSuccess();
+        if (!wasConnected)
+        {
+            isGScriptConnected = true;
+            updateOLEDStatus("GScript", "Reconnected!");
+            successBeep();
         }
+        return;
+    }
 
-        if (!testGoogleScriptConnection())
-        {
-            isGScriptConnected = false;
-            updateOLEDStatus("GScript Lost", "Reconnecting..."); 
-            digitalWrite(LED_RED, HIGH);
-            errorBeep();
+    // Probe idle yang gagal diperlakukan sama seperti upload gagal: koneksi
+    // baru dianggap putus saat circuit breaker open
+    recordGScriptFailure();
+    if (wasConnected)
+    {
+        gscriptHealth.idleProbeFailures++;
+        return;
+    }
+    updateOLEDStatus("GScript Offline", "Retry " + String(gscriptRetryWaitMs() / 1000) + "s");
+}
 
-            gScriptConnectionFailureCount++;
-            if (gScriptConnectionFailureCount >= MAX_GSCRIPT_CONNECTION_FAILURES)
-            {
-                showErrorOLED("Hubungi tim IT");
-                digitalWrite(LED_RED, HIGH);
-                mfrc522.PCD_AntennaOff();  // Keep RFID disabled
-                isProcessing = true;        // Keep RFID processing blocked
-                return;  // Don't enable RFID if max failures reached
-            }
-            else if (initGoogleApps())
+void waitForGScript()
+{
+    for (;;)
+    {
+        bool online = !isOTAInProgress && WiFi.status() == WL_CONNECTED;
+        if (online)
+        {
+            checkGScriptConnection();
+            if (isGScriptConnected && gscriptRetryWaitMs() == 0)
             {
-                isGScriptConnected = true;
-                digitalWrite(LED_RED, LOW);
-                updateOLEDStatus("GScript", "Reconnected!");
-                successBeep();
-                gScriptConnectionFailureCount = 0;
-                
-                // Re-enable RFID only if reconnection successful
-                mfrc522.PCD_AntennaOn();
-                isProcessing = false;
+                return;
             }
         }
-        else
-        {
-            // Koneksi berhasil
-            digitalWrite(LED_YELLOW, LOW);
-            digitalWrite(LED_GREEN, HIGH);
-            gScriptConnectionFailureCount = 0;
-
-            // Tampilkan status default
-            showDefaultOLEDDisplay();
-            
-            // Re-enable RFID only after successful check
-            mfrc522.PCD_AntennaOn();
-            isProcessing = false;
-        }
 
-        // Jika masih ada masalah koneksi, keep RFID disabled
-        if (!isGScriptConnected) {
-            mfrc522.PCD_AntennaOff();
-            isProcessing = true;
-            updateOLEDStatus("GScript Error", "RFID Disabled");
-            digitalWrite(LED_RED, HIGH);
-        }
+        unsigned long wait = gscriptRetryWaitMs();
+        vTaskDelay(pdMS_TO_TICKS(wait > 0 && wait < 1000 ? wait : 1000));
     }
 }
 
-// Fungsi untuk mengirim data yang tersimpan di buffer
-bool processPendingData()
+unsigned long gscriptBackoffDelay(int failures)
 {
-    if (!isGScriptConnected) {
-        return false;
+    // Equal jitter: setengah jeda tetap, setengah acak, agar perangkat yang
+    // gagal bersamaan tidak retry bersamaan tetapi jeda tidak pernah ~0
+    unsigned long ceiling = GSCRIPT_BACKOFF_BASE << min(failures - 1, 10);
+    if (ceiling > GSCRIPT_BACKOFF_MAX)
+    {
+        ceiling = GSCRIPT_BACKOFF_MAX;
     }
+    return ceiling / 2 + esp_random() % (ceiling / 2 + 1);
+}
 
-    unsigned long currentTime = millis();
-    bool shouldSend = false;
-
-    // Cek apakah sudah mencapai minimum batch size
-    if (rfidBuffer.count >= MIN_BATCH_SIZE) {
-        shouldSend = true;
-        updateOLEDStatus("Buffer Full", "Sending data...");
-    }
-    // Cek apakah timeout tercapai dan ada data
-    else if (rfidBuffer.count > 0 && (currentTime - lastDataTime) >= SEND_TIMEOUT) {
-        shouldSend = true;
-        updateOLEDStatus("Timeout", "Sending data...");
+bool gscriptCallAllowed()
+{
+    if (gscriptRetryWaitMs() > 0)
+    {
+        return false;
     }
-
-    if (shouldSend) {
-        String batchData = prepareDataForBatch();
-        if (!batchData.isEmpty()) {
-            bool result = sendBatchToGScript(batchData);
-            if (result) {
-                lastDataTime = currentTime;  // Reset timer
-                return true;
-            }
-        }
+    if (gscriptBreaker.state == BREAKER_OPEN)
+    {
+        gscriptBreaker.state = BREAKER_HALF_OPEN;
+        gscriptBreaker.probes++;
+        Serial.println("GScript circuit half-open: probing");
     }
+    return true;
+}
 
-    return false;
+unsigned long gscriptRetryWaitMs()
+{
+    long remaining = (long)(gscriptBreaker.nextAttemptAt - millis());
+    return remaining > 0 ? remaining : 0;
 }
 
-// Function untuk dipanggil di setup()
-void setupGoogleApps()
+void recordGScriptSuccess()
 {
-    if (WiFi.status() == WL_CONNECTED)
+    if (gscriptBreaker.state != BREAKER_CLOSED)
     {
-        initGoogleApps();
+        Serial.printf("GScript circuit closed after %d failures\n", gscriptBreaker.consecutiveFailures);
     }
+    gscriptHealth.lastSuccess = millis();
+    gscriptBreaker.state = BREAKER_CLOSED;
+    gscriptBreaker.consecutiveFailures = 0;
+    gscriptBreaker.nextAttemptAt = millis();
+    gscriptBreaker.lastBackoffMs = 0;
 }
 
-// Function untuk dipanggil di loop()
-void handleGoogleApps()
+const char *gscriptHealthState()
 {
-    if (WiFi.status() == WL_CONNECTED)
+    if (!isGScriptConnected)
     {
-        checkGScriptConnection();
-        processPendingData();
+        return "down";
     }
+    return gscriptBreaker.consecutiveFailures > 0 ? "degraded" : "healthy";
 }
 
-// =========================
-// ======= RFID FUNCTIONS =======
-// =========================
-
-void initRFID()
+void recordGScriptFailure()
 {
-    SPI.begin();
-    mfrc522.PCD_Init();
+    gscriptHealth.lastFailure = millis();
+    gscriptBreaker.consecutiveFailures++;
+    gscriptBreaker.lastBackoffMs = gscriptBackoffDelay(gscriptBreaker.consecutiveFailures);
+    gscriptBreaker.nextAttemptAt = millis() + gscriptBreaker.lastBackoffMs;
 
-    // Initialize RFID key (default)
-    for (byte i = 0; i < 6; i++)
+    bool trip = gscriptBreaker.state == BREAKER_CLOSED && gscriptBreaker.consecutiveFailures >= GSCRIPT_BREAKER_THRESHOLD;
+    if (trip || gscriptBreaker.state == BREAKER_HALF_OPEN)
     {
-        key.keyByte[i] = 0xFF;
+        if (trip)
+        {
+            gscriptBreaker.trips++;
+        }
+        gscriptBreaker.state = BREAKER_OPEN;
+        isGScriptConnected = false; // Batch berikutnya menunggu probe berhasil
+        Serial.printf("GScript circuit open: %d failures, next probe in %lu ms\n",
+                      gscriptBreaker.consecutiveFailures, gscriptBreaker.lastBackoffMs);
     }
+    else
+    {
+        Serial.printf("GScript request failed (%d), retry in %lu ms\n",
+                      gscriptBreaker.consecutiveFailures, gscriptBreaker.lastBackoffMs);
+    }
+}
 
-    // Reset buffer state
-    rfidBuffer.head = 0;
-    rfidBuffer.tail = 0;
-    rfidBuffer.count = 0;
-
-    updateOLEDStatus("RFID Ready", "Waiting for card");
-    Serial.println("RFID subsystem initialized");
+// Fungsi untuk mengirim data yang tersimpan di buffer
+uint32_t unsealedRecordCount()
+{
+    JournalLock lock;
+    return journal.pendingCount > uploader.sealedRecords ? journal.pendingCount - uploader.sealedRecords : 0;
 }
 
-bool addToBuffer(const RFIDData &data)
+// Dipanggil dari loop(): hanya menyegel batch, pengiriman di uploadTask()
+bool processPendingData()
 {
-    if (rfidBuffer.count >= MAX_BUFFER_SIZE)
-    {
+    if (!isGScriptConnected) {
         return false;
     }
 
-    rfidBuffer.data[rfidBuffer.tail] = data;
-    rfidBuffer.tail = (rfidBuffer.tail + 1) % MAX_BUFFER_SIZE;
-    rfidBuffer.count++;
-    lastDataTime = millis();  // Update waktu data terakhir
-
-    return true;
-}
+    uint32_t unsealed = unsealedRecordCount();
+    if (unsealed == 0) {
+        return false;
+    }
 
-// Update the readRFIDBlock function to properly handle the data
-String readRFIDBlock(byte blockAddr) {
-    status = mfrc522.PCD_Authenticate(MFRC522::PICC_CMD_MF_AUTH_KEY_A, blockAddr, &key, &(mfrc522.uid));
-    if (status != MFRC522::STATUS_OK) {
-        return "";
+    updateBatchSchedule();
+
+    // Segel saat target ukuran tercapai, atau record tertua sudah menunggu
+    // selama budget flush
+    unsigned long age = millis() - batchScheduler.oldestUnsealed;
+    FlushReason reason = FLUSH_NONE;
+    if (unsealed >= (uint32_t)MAX_BATCH_SIZE) {
+        reason = FLUSH_BACKLOG;
+    } else if (unsealed >= (uint32_t)batchScheduler.targetSize) {
+        reason = FLUSH_SIZE;
+    } else if (age >= batchScheduler.flushBudgetMs) {
+        reason = FLUSH_DEADLINE;
+    }
+    if (reason == FLUSH_NONE) {
+        return false;
     }
 
-    status = mfrc522.MIFARE_Read(blockAddr, readBlockData, &bufferLen);
-    if (status != MFRC522::STATUS_OK) {
-        return "";
+    // Backlog (setelah offline / GScript down) dikirim dengan jeda antar
+    // batch agar upload tidak terus memakai CPU, flash & mutex journal
+    // yang juga dipakai loop() untuk menyimpan scan baru
+    static unsigned long lastSeal = 0;
+    if (backlogDraining() && millis() - lastSeal < BACKLOG_DRAIN_INTERVAL) {
+        return false;
     }
 
-    String data;
-    for (uint8_t i = 0; i < 16; i++) {
-        // Only add printable characters
-        if (readBlockData[i] >= 32 && readBlockData[i] <= 126) {
-            data += (char)readBlockData[i];
-        }
+    int count = min((int)unsealed, MAX_BATCH_SIZE);
+    if (!sealUploadBatch()) {
+        return false;
     }
-    
-    return cleanString(data); // Clean the string before returning
+    lastSeal = millis();
+
+    batchScheduler.lastReason = reason;
+    batchScheduler.lastBatchSize = count;
+    batchScheduler.lastBatchAgeMs = age;
+    Serial.printf("Sealed %d records (%s): target %d, budget %lu ms, age %lu ms, scan every %.0f ms, upload %.0f ms\n",
+                  count, FLUSH_REASON_NAMES[reason], batchScheduler.targetSize, batchScheduler.flushBudgetMs, age,
+                  batchScheduler.arrivalIntervalMs, batchScheduler.uploadLatencyMs);
+    return true;
 }
 
-void resetRFIDModule() {
-    mfrc522.PCD_Reset();
-    delay(50);
-    mfrc522.PCD_Init();
-    
-    // Reset authentication state
-    mfrc522.PCD_StopCrypto1();
-    
-    // Re-initialize key
-    for (byte i = 0; i < 6; i++) {
-        key.keyByte[i] = 0xFF;
-    }
+bool backlogDraining()
+{
+    return journal.pendingCount > (uint32_t)MAX_BATCH_SIZE;
 }
 
-void processRFIDCard() {
-    static uint8_t failureCount = 0;
-    static unsigned long lastFailureTime = 0;
-    const uint8_t MAX_FAILURES = 3;
-    const unsigned long RECOVERY_TIME = 1000; // 1 detik untuk recovery
+uint32_t backlogDrainEtaSeconds()
+{
+    uint32_t batches = (journal.pendingCount + MAX_BATCH_SIZE - 1) / MAX_BATCH_SIZE;
+    float perBatchMs = max((float)BACKLOG_DRAIN_INTERVAL, batchScheduler.uploadLatencyMs);
+    return (uint32_t)(batches * perBatchMs / 1000);
+}
 
-    if (isProcessing || isSending) {
-        return;
+void noteScanArrival(unsigned long timestamp)
+{
+    if (batchScheduler.lastArrival != 0) {
+        float interval = timestamp - batchScheduler.lastArrival;
+        batchScheduler.arrivalIntervalMs += SCHEDULER_EWMA_ALPHA * (interval - batchScheduler.arrivalIntervalMs);
     }
-
-    // Basic presence check with timeout
-    unsigned long startTime = millis();
-    bool cardDetected = false;
-    
-    while (millis() - startTime < READ_TIMEOUT) {
-        if (mfrc522.PICC_IsNewCardPresent()) {
-            cardDetected = true;
-            break;
-        }
-        delay(5);
+    batchScheduler.lastArrival = timestamp;
+    if (batchScheduler.oldestUnsealed == 0) {
+        batchScheduler.oldestUnsealed = timestamp;
     }
+}
 
-    if (!cardDetected) {
-        return;
+void noteUploadLatency(uint32_t durationMs)
+{
+    if (batchScheduler.uploadLatencyMs == 0) {
+        batchScheduler.uploadLatencyMs = durationMs;
+    } else {
+        batchScheduler.uploadLatencyMs += SCHEDULER_EWMA_ALPHA * ((float)durationMs - batchScheduler.uploadLatencyMs);
     }
+}
 
-    // Try to read serial with timeout
-    startTime = millis();
-    bool serialRead = false;
-    
-    while (millis() - startTime < READ_TIMEOUT) {
-        if (mfrc522.PICC_ReadCardSerial()) {
-            serialRead = true;
-            break;
-        }
-        delay(5);
+void updateBatchSchedule()
+{
+    // Batch yang masih antri/terkirim ikut memakan delay record baru
+    UBaseType_t queued = uploader.queue ? uxQueueMessagesWaiting(uploader.queue) : 0;
+    float uploadCost = batchScheduler.uploadLatencyMs * (1 + queued);
+    float budget = MAX_DELIVERY_DELAY - uploadCost;
+    batchScheduler.flushBudgetMs = budget > MIN_FLUSH_BUDGET ? (unsigned long)budget : MIN_FLUSH_BUDGET;
+
+    // Saat sepi EWMA belum sempat naik: jeda sejak scan terakhir juga dihitung
+    float interval = batchScheduler.arrivalIntervalMs;
+    float idle = millis() - batchScheduler.lastArrival;
+    if (idle > interval) {
+        interval = idle;
     }
 
-    if (!serialRead) {
-        failureCount++;
-        lastFailureTime = millis();
-        updateOLEDStatus("Read Error", "Please try again");
-        errorBeep();
-        blinkLED(LED_RED, 2, 200);
+    // Jumlah scan yang diperkirakan masuk selama budget; bila kurang dari
+    // satu, menunggu tidak menghemat request dan batch langsung dikirim
+    float expected = batchScheduler.flushBudgetMs / (interval > 1 ? interval : 1);
+    batchScheduler.targetSize = constrain((int)expected, 1, MAX_BATCH_SIZE);
+}
 
-        // Cek jika failure count mencapai threshold
-        if (failureCount >= MAX_FAILURES) {
-            // Update OLED
-            updateOLEDStatus("Critical Error", "Sending buffer...");
-            digitalWrite(LED_RED, HIGH);
-            errorBeep();
-            
-            // Kirim data yang ada di buffer
-            if (rfidBuffer.count > 0) {
-                String batchData = prepareDataForBatch();
-                if (!batchData.isEmpty()) {
-                    // Update OLED dengan status pengiriman
-                    updateOLEDStatus("Sending Data", "Before restart...");
-                    
-                    if (sendBatchToGScript(batchData)) {
-                        updateOLEDStatus("Data Sent", "Restarting...");
-                        successBeep();
-                        blinkLED(LED_GREEN, 2, 200);
-                    } else {
-                        updateOLEDStatus("Send Failed", "Restarting...");
-                        errorBeep();
-                        blinkLED(LED_RED, 3, 200);
-                    }
-                }
-            } else {
-                updateOLEDStatus("No Data", "Restarting...");
-            }
-            
-            // Delay sebelum restart
-            delay(2000);
-            ESP.restart();
-        }
-        return;
+bool sealUploadBatch()
+{
+    if (uploader.queue == nullptr || uxQueueSpacesAvailable(uploader.queue) == 0) {
+        return false;
     }
 
-    // Check cooldown period
-    if (millis() - lastSuccessfulRead < READ_COOLDOWN) {
-        return;
-    }
+    UploadBatch batch;
+    batch.ackedCount = 0;
+    batch.rejectSequence = 0;
+    batch.rejectCount = 0;
+    {
+        // Hanya menghitung frame; isi record dibaca ulang saat dikirim
+        JournalLock lock;
+        batch.from = uploader.sealed;
+        batch.count = journalPeek(uploader.sealed, nullptr, MAX_BATCH_SIZE, batch.next);
+        if (batch.count == 0) {
+            return false;
+        }
+        uploader.sealed = batch.next;
+        uploader.sealedRecords += batch.count;
 
-    isProcessing = true;
-    digitalWrite(LED_YELLOW, HIGH);
-    updateOLEDStatus("Reading Card", "Please wait...");
-
-    // Prepare RFID data structure
-    RFIDData newData;
-    newData.timestamp = millis();
-
-    // Read UID
-    String uid = "";
-    for (byte i = 0; i < mfrc522.uid.size; i++) {
-        uid += (mfrc522.uid.uidByte[i] < 0x10 ? "0" : "");
-        uid += String(mfrc522.uid.uidByte[i], HEX);
-    }
-    newData.uid = uid;
-
-    // Read all configured blocks dengan format baru: NISN, NIP, Nama
-    bool readSuccess = true;
-    for (byte i = 0; i < total_blocks; i++) {
-        String blockData = readRFIDBlock(blocks[i]);
-        if (blockData.length() > 0) {
-            newData.blockData[i] = blockData;
-            String blockType;
-            switch(i) {
-                case 0: blockType = "NISN"; break;
-                case 1: blockType = "NIP"; break;
-                case 2: blockType = "Nama"; break;
-            }
-            Serial.println(blockType + ": " + blockData);
-        } else {
-            readSuccess = false;
-            failureCount++;
-            lastFailureTime = millis();
-            break;
+        // Sisa record lebih baru dari batch ini; umur lama tetap dipakai
+        // (konservatif) agar backlog tidak menunggu budget penuh lagi
+        if (journal.pendingCount <= uploader.sealedRecords) {
+            batchScheduler.oldestUnsealed = 0;
         }
     }
 
-    if (readSuccess) {
-        if (addToBuffer(newData)) {
-            // Reset failure count on success
-            failureCount = 0;
-            lastSuccessfulRead = millis();
+    xQueueSend(uploader.queue, &batch, 0);
+    return true;
+}
 
-            // Show the name that was just read (index 2 is Nama)
-            String displayName = cleanString(newData.blockData[2]);
-            if (displayName.length() > 16) {
-                displayName = displayName.substring(0, 13) + "...";
+void initUploader()
+{
+    uploader.queue = xQueueCreate(UPLOAD_QUEUE_DEPTH, sizeof(UploadBatch));
+    uploader.sealed = journal.head;
+    if (journal.pendingCount > 0) {
+        // Record dari sebelum reboot: umurnya tidak diketahui, kirim secepatnya
+        batchScheduler.oldestUnsealed = millis() - MAX_DELIVERY_DELAY;
+    }
+    xTaskCreatePinnedToCore(uploadTask, "upload", UPLOAD_TASK_STACK, nullptr,
+                            UPLOAD_TASK_PRIORITY, &uploader.task, UPLOAD_TASK_CORE);
+}
+
+// Satu-satunya pemakai koneksi GScript setelah setup(): upload batch dan cek
+// koneksi periodik berjalan di sini sehingga loop() & task RFID tidak pernah
+// menunggu jaringan.
+void uploadTask(void *parameter)
+{
+    UploadBatch batch;
+
+    for (;;)
+    {
+        waitForGScript();
+
+        if (xQueueReceive(uploader.queue, &batch, pdMS_TO_TICKS(1000)) != pdTRUE)
+        {
+            continue;
+        }
+
+        // Batch tidak pernah dibuang: dikirim ulang sampai server menerima,
+        // batch berikutnya menunggu di antrian agar urutan journal terjaga.
+        // Jeda antar percobaan mengikuti retry policy.
+        while (!sendSealedBatch(batch))
+        {
+            uploader.failedAttempts++;
+            waitForGScript();
+        }
+    }
+}
+
+bool sendSealedBatch(UploadBatch &batch)
+{
+    unsigned long start = millis();
+    if (!sendBatchToGScript(batch))
+    {
+        recordGScriptFailure();
+        updateOLEDStatus("Send Failed", "Retry " + String(gscriptRetryWaitMs() / 1000) + "s");
+        blinkLED(LED_RED, 1, 200);
+        beep(2, 100);
+        return false;
+    }
+
+    uploader.lastUploadMs = millis() - start;
+    noteUploadLatency(uploader.lastUploadMs);
+
+    int committed = batch.count;
+    if (batchAck.legacy())
+    {
+        commitUploadBatch(batch);
+        batch.count = 0;
+    }
+    else
+    {
+        for (uint8_t i = 0; i < batchAck.acceptedCount && batch.ackedCount < ACK_MAX_RANGES; i++)
+        {
+            batch.acked[batch.ackedCount++] = batchAck.accepted[i];
+        }
+        committed = commitAcknowledgedRows(batch);
+        if (batch.count > 0 && releaseRejectedRow(batch))
+        {
+            committed += 1 + commitAcknowledgedRows(batch);
+        }
+    }
+
+    if (batch.count == 0)
+    {
+        recordGScriptSuccess();
+        uploader.batchesSent++;
+        return true;
+    }
+
+    // Sebagian baris ditolak: sisanya dikirim ulang setelah jeda retry.
+    // Ada kemajuan (baris di-commit atau dipindah ke dead letter) = server
+    // sehat, jadi jeda mulai lagi dari yang terpendek. Tanpa kemajuan jeda
+    // terus naik agar endpoint tidak dipukul berulang.
+    uploader.partialAcks++;
+    if (committed > 0)
+    {
+        recordGScriptSuccess();
+        gscriptBreaker.lastBackoffMs = gscriptBackoffDelay(1);
+        gscriptBreaker.nextAttemptAt = millis() + gscriptBreaker.lastBackoffMs;
+    }
+    else
+    {
+        recordGScriptFailure();
+    }
+    Serial.printf("Batch partially accepted: %d committed, %d to resend, %lu rejected\n",
+                  committed, batch.count, (unsigned long)batchAck.rejectedRows());
+    return false;
+}
+
+bool sequenceAcknowledged(const UploadBatch &batch, uint32_t sequence)
+{
+    for (uint8_t i = 0; sequence != 0 && i < batch.ackedCount; i++)
+    {
+        if (sequence >= batch.acked[i].first && sequence <= batch.acked[i].last)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Baris terdepan batch (yang menahan head journal) ditolak server: setelah
+// MAX_ROW_REJECTS jawaban berturut-turut, salin ke DEAD_LETTER_FILE lalu
+// commit agar baris di belakangnya bisa maju. Return true bila dilepas.
+bool releaseRejectedRow(UploadBatch &batch)
+{
+    RFIDData row;
+    JournalCursor next;
+    if (journalPeek(batch.from, &row, 1, next) != 1 || !batchAck.sequenceRejected(row.sequence))
+    {
+        batch.rejectCount = 0;
+        return false;
+    }
+
+    if (row.sequence != batch.rejectSequence)
+    {
+        batch.rejectSequence = row.sequence;
+        batch.rejectCount = 0;
+    }
+    if (++batch.rejectCount < MAX_ROW_REJECTS)
+    {
+        return false;
+    }
+
+    char line[BATCH_ROW_MAX + 1];
+    size_t length = renderBatchRowCsv(row, clockSnapshot(), line);
+    File file = LittleFS.open(DEAD_LETTER_FILE, "a");
+    bool saved = file && file.size() + length <= DEAD_LETTER_MAX_BYTES && file.write((const uint8_t *)line, length) == length;
+    if (file)
+    {
+        file.close();
+    }
+    Serial.printf("Row %lu rejected %u times, released from journal (%s)\n", (unsigned long)row.sequence,
+                  batch.rejectCount, saved ? "saved to " DEAD_LETTER_FILE : "dead letter full");
+
+    UploadBatch done = batch;
+    done.next = next;
+    done.count = 1;
+    commitUploadBatch(done);
+    batch.from = next;
+    batch.count--;
+    batch.rejectSequence = 0;
+    batch.rejectCount = 0;
+    uploader.deadLettered++;
+    uploader.lastDeadLetter = row.sequence;
+    return true;
+}
+
+// Head journal hanya bisa maju, jadi yang di-commit adalah awalan batch yang
+// seluruhnya sudah di-ack. Baris ter-ack di belakang baris yang ditolak
+// tetap di journal tetapi tidak ikut dikirim ulang (batch.acked).
+int commitAcknowledgedRows(UploadBatch &batch)
+{
+    RFIDData window[BATCH_STREAM_WINDOW];
+    JournalCursor cursor = batch.from;
+    int prefix = 0;
+
+    while (prefix < batch.count)
+    {
+        JournalCursor next;
+        int n = journalPeek(cursor, window, min(BATCH_STREAM_WINDOW, batch.count - prefix), next);
+        if (n == 0)
+        {
+            break;
+        }
+
+        // Frame rusak tidak pernah dikirim; ikut jawaban yang valid
+        int acknowledged = 0;
+        while (acknowledged < n && (window[acknowledged].uidLength == 0 ||
+                                    sequenceAcknowledged(batch, window[acknowledged].sequence)))
+        {
+            acknowledged++;
+        }
+
+        if (acknowledged < n)
+        {
+            if (acknowledged > 0)
+            {
+                journalPeek(cursor, nullptr, acknowledged, next);
+                cursor = next;
+            }
+            prefix += acknowledged;
+            break;
+        }
+        cursor = next;
+        prefix += n;
+    }
+
+    if (prefix > 0)
+    {
+        UploadBatch done = batch;
+        done.next = cursor;
+        done.count = prefix;
+        commitUploadBatch(done);
+
+        batch.from = cursor;
+        batch.count -= prefix;
+    }
+    return prefix;
+}
+
+// Function untuk dipanggil di setup()
+void setupGoogleApps()
+{
+    if (WiFi.status() == WL_CONNECTED)
+    {
+        initGoogleApps();
+    }
+}
+
+// Function untuk dipanggil di loop()
+void handleGoogleApps()
+{
+    if (WiFi.status() == WL_CONNECTED)
+    {
+        // Cek koneksi periodik dijalankan oleh uploadTask()
+        processPendingData();
+    }
+}
+
+// =========================
+// ======= RFID FUNCTIONS =======
+// =========================
+
+void initRFID()
+{
+    SPI.begin();
+    initRFIDOnSharedBus(false);
+
+    // Initialize RFID key (default)
+    for (byte i = 0; i < 6; i++)
+    {
+        key.keyByte[i] = 0xFF;
+    }
+
+    buildCardReadPlan();
+
+    updateOLEDStatus("RFID Ready", "Waiting for card");
+    Serial.println("RFID subsystem initialized");
+
+    // Pembacaan kartu berjalan di core terpisah dari WiFi, upload & web server
+    xTaskCreatePinnedToCore(rfidTask, "rfid", RFID_TASK_STACK, nullptr,
+                            RFID_TASK_PRIORITY, &rfidTaskHandle, RFID_TASK_CORE);
+
+#if RFID_USE_IRQ
+    // Pin IRQ MFRC522 open-drain, aktif-low (IRqInv di ComIEnReg)
+    pinMode(RFID_IRQ_PIN, INPUT_PULLUP);
+    attachInterrupt(digitalPinToInterrupt(RFID_IRQ_PIN), rfidIrqHandler, FALLING);
+    Serial.println("RFID card detection: IRQ on pin " + String(RFID_IRQ_PIN));
+#else
+    Serial.println("RFID card detection: polling");
+#endif
+}
+
+#if RFID_USE_IRQ
+void IRAM_ATTR rfidIrqHandler()
+{
+    BaseType_t higherPriorityTaskWoken = pdFALSE;
+    vTaskNotifyGiveFromISR(rfidTaskHandle, &higherPriorityTaskWoken);
+    portYIELD_FROM_ISR(higherPriorityTaskWoken);
+}
+
+// MFRC522 tidak bisa mendeteksi kartu tanpa memancarkan perintah, jadi REQA
+// dipasang di sini lalu task tidur sampai IRQ menandakan jawaban ATQA dari
+// kartu (RxIRq) atau RFID_IRQ_REARM_MS habis. Tidak ada polling SPI selama
+// menunggu; kartu langsung di-select setelah bangun. Frame noise/tabrakan
+// juga memicu RxIRq, jadi jawaban baru dianggap kartu bila ErrorReg bersih
+// dan FIFO berisi tepat 2 byte ATQA (sama seperti PICC_IsNewCardPresent).
+bool waitForCardIRQ()
+{
+    // Buang notifikasi dari IRQ transaksi kartu sebelumnya
+    ulTaskNotifyTake(pdTRUE, 0);
+
+    mfrc522.PCD_WriteRegister(MFRC522::ComIEnReg, 0xA0);    // IRqInv + RxIEn
+    mfrc522.PCD_WriteRegister(MFRC522::ComIrqReg, 0x7F);    // Hapus semua flag interrupt
+    mfrc522.PCD_WriteRegister(MFRC522::FIFOLevelReg, 0x80); // Flush FIFO
+    mfrc522.PCD_WriteRegister(MFRC522::FIFODataReg, MFRC522::PICC_CMD_REQA);
+    mfrc522.PCD_WriteRegister(MFRC522::CommandReg, MFRC522::PCD_Transceive);
+    mfrc522.PCD_WriteRegister(MFRC522::BitFramingReg, 0x87); // StartSend, frame 7 bit
+
+    if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(RFID_IRQ_REARM_MS)) == 0)
+    {
+        return false;
+    }
+
+    byte error = mfrc522.PCD_ReadRegister(MFRC522::ErrorReg);
+    byte fifoLevel = mfrc522.PCD_ReadRegister(MFRC522::FIFOLevelReg) & 0x7F;
+    byte lastBits = mfrc522.PCD_ReadRegister(MFRC522::ControlReg) & 0x07;
+    if (error != 0 || fifoLevel != 2 || lastBits != 0)
+    {
+        // Bukan ATQA yang utuh: kirim ulang REQA tanpa feedback
+        rfidSpuriousIrqs++;
+        return false;
+    }
+
+    byte atqa[2];
+    mfrc522.PCD_ReadRegister(MFRC522::FIFODataReg, sizeof(atqa), atqa);
+    return true;
+}
+#endif
+
+bool rfidScanBlocked()
+{
+    return isProcessing || !rfidAcceptingScans || rfidRestartRequested;
+}
+
+// Loop utama task RFID. Hanya task ini yang mengakses MFRC522 lewat SPI.
+void rfidTask(void *parameter)
+{
+    bool antennaOn = true;
+
+    for (;;)
+    {
+        // Terapkan permintaan setRFIDEnabled() dari loop()
+        if (isProcessing == antennaOn)
+        {
+            if (antennaOn)
+            {
+                mfrc522.PCD_AntennaOff();
+            }
+            else
+            {
+                mfrc522.PCD_AntennaOn();
+            }
+            antennaOn = !antennaOn;
+        }
+
+        processRFIDCard();
+
+        // Di antara kartu, lepaskan CPU agar idle task (watchdog) tetap jalan.
+        // Di tengah sesi kartu, lanjut ke tahap berikutnya tanpa menunggu tick.
+        if (scanContext.state == SCAN_IDLE)
+        {
+#if RFID_USE_IRQ
+            if (antennaOn && !rfidScanBlocked())
+            {
+                rfidCardSignalled = waitForCardIRQ();
+            }
+            else
+            {
+                rfidCardSignalled = false;
+                vTaskDelay(1);
+            }
+#else
+            vTaskDelay(1);
+#endif
+        }
+        else
+        {
+            taskYIELD();
+        }
+    }
+}
+
+void setRFIDEnabled(bool enabled)
+{
+    isProcessing = !enabled;
+}
+
+// Dipanggil dari loop(): pindahkan record dari antrian lock-free ke journal
+void drainScanQueue()
+{
+    RFIDData record;
+    while (scanQueue.peek(record))
+    {
+        // Journal penuh: biarkan record di antrian sampai ada ruang
+        if (!addToBuffer(record))
+        {
+            break;
+        }
+        scanQueue.discard();
+    }
+}
+
+uint32_t pendingScanCount()
+{
+    return journal.pendingCount + scanQueue.size();
+}
+
+bool addToBuffer(const RFIDData &data)
+{
+    if (!journalAppend(data))
+    {
+        return false;
+    }
+
+    lastDataTime = millis();  // Update waktu data terakhir
+    noteScanArrival(data.timestamp != 0 ? data.timestamp : lastDataTime);
+
+    return true;
+}
+
+// Nomor sektor MIFARE Classic: 4 blok per sektor untuk 32 sektor pertama,
+// 16 blok per sektor setelahnya (kartu 4K)
+byte mifareSectorOf(byte block) {
+    return block < 128 ? block / 4 : 32 + (block - 128) / 16;
+}
+
+void buildCardReadPlan() {
+    // Kumpulkan blok unik; beberapa field boleh berbagi satu blok
+    byte uniqueBlocks[MAX_READ_STEPS];
+    byte blockCount = 0;
+    for (byte i = 0; i < CARD_FIELD_COUNT; i++) {
+        bool seen = false;
+        for (byte j = 0; j < blockCount; j++) {
+            if (uniqueBlocks[j] == CARD_LAYOUT[i].block) seen = true;
+        }
+        if (!seen && blockCount < MAX_READ_STEPS) {
+            uniqueBlocks[blockCount++] = CARD_LAYOUT[i].block;
+        }
+    }
+
+    // Urutkan agar blok dalam sektor yang sama berdampingan
+    for (byte i = 1; i < blockCount; i++) {
+        byte value = uniqueBlocks[i];
+        byte j = i;
+        while (j > 0 && uniqueBlocks[j - 1] > value) {
+            uniqueBlocks[j] = uniqueBlocks[j - 1];
+            j--;
+        }
+        uniqueBlocks[j] = value;
+    }
+
+    cardReadPlan.count = 0;
+    cardReadPlan.authCount = 0;
+    int lastSector = -1;
+    for (byte i = 0; i < blockCount; i++) {
+        ReadStep &step = cardReadPlan.steps[cardReadPlan.count++];
+        step.block = uniqueBlocks[i];
+        step.authenticate = mifareSectorOf(step.block) != lastSector;
+        if (step.authenticate) cardReadPlan.authCount++;
+        lastSector = mifareSectorOf(step.block);
+    }
+
+    Serial.printf("Card read plan: %u fields, %u reads, %u authentications\n",
+                  CARD_FIELD_COUNT, cardReadPlan.count, cardReadPlan.authCount);
+}
+
+// Membaca isi blok yang sudah diautentikasi ke readBlockData
+bool readRFIDBlock(byte blockAddr) {
+    bufferLen = sizeof(readBlockData);
+    status = mfrc522.MIFARE_Read(blockAddr, readBlockData, &bufferLen);
+    return status == MFRC522::STATUS_OK;
+}
+
+void decodeCardField(const CardField &field, const byte *blockData, char *out, size_t outSize) {
+    size_t length = 0;
+    for (byte i = field.offset; i < field.offset + field.length && i < 16; i++) {
+        char c = (char)blockData[i];
+        bool keep = field.encoding == FIELD_DIGITS ? (c >= '0' && c <= '9') : (c >= 32 && c <= 126);
+        if (keep && length + 1 < outSize) {
+            out[length++] = c;
+        }
+    }
+    out[length] = '\0';
+
+    // Trim leading & trailing whitespace tanpa alokasi
+    size_t start = 0;
+    while (start < length && isSpace(out[start])) start++;
+    while (length > start && isSpace(out[length - 1])) length--;
+    memmove(out, out + start, length - start);
+    out[length - start] = '\0';
+}
+
+void reportCardReadStats() {
+    Serial.printf("Card read (%u reads, %u auth):", cardReadPlan.count, cardReadPlan.authCount);
+    for (byte i = 0; i < CARD_FIELD_COUNT; i++) {
+        uint32_t average = cardReadStats.totalFieldMicros[i] / max((uint32_t)1, cardReadStats.fullReads);
+        Serial.printf(" %s %luus (avg %luus)", CARD_LAYOUT[i].name, (unsigned long)cardReadStats.lastFieldMicros[i], (unsigned long)average);
+    }
+    Serial.println();
+}
+
+// FNV-1a di atas byte UID mentah
+uint32_t hashUID(const byte *uid, byte uidLength) {
+    uint32_t hash = 2166136261u;
+    for (byte i = 0; i < uidLength; i++) {
+        hash ^= uid[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+bool isDuplicateScan(uint32_t uidHash) {
+    unsigned long now = millis();
+    for (RecentUIDEntry &entry : recentUIDs.entries) {
+        if (entry.used && entry.uidHash == uidHash) {
+            recentUIDs.hits++;
+            if (now - entry.lastSeen < DUPLICATE_SCAN_WINDOW) {
+#if DUPLICATE_SCAN_SLIDING
+                // Perpanjang jendela selama kartu terus ditempelkan ulang
+                entry.lastSeen = now;
+#endif
+                recentUIDs.drops++;
+                return true;
+            }
+            return false;
+        }
+    }
+    return false;
+}
+
+void rememberScan(uint32_t uidHash) {
+    unsigned long now = millis();
+    RecentUIDEntry *slot = nullptr;
+
+    // Pakai slot milik kartu ini, lalu slot kosong, lalu slot yang paling lama tidak dipakai
+    for (RecentUIDEntry &entry : recentUIDs.entries) {
+        if (entry.used && entry.uidHash == uidHash) {
+            slot = &entry;
+            break;
+        }
+        if (!entry.used) {
+            if (slot == nullptr || slot->used) slot = &entry;
+        } else if (slot == nullptr || (slot->used && now - entry.lastSeen > now - slot->lastSeen)) {
+            slot = &entry;
+        }
+    }
+
+    slot->uidHash = uidHash;
+    slot->lastSeen = now;
+    slot->used = true;
+}
+
+void beginReadStep() {
+    scanContext.stepStartMicros = micros();
+    setScanState(cardReadPlan.steps[scanContext.stepIndex].authenticate ? SCAN_AUTHENTICATE : SCAN_READ);
+}
+
+// RST_PIN berbagi GPIO dengan SDA OLED (Wire.begin(33, 32)) dan PCD_Init()
+// mengubah mode pin tersebut. Semua PCD_Init() lewat sini: dijalankan saat
+// tidak ada transaksi I2C, lalu pin dikembalikan ke Wire.
+void initRFIDOnSharedBus(bool hardReset) {
+    DisplayLock lock;
+    if (hardReset) {
+        // PCD_Init() mengembalikan pin RST ke INPUT, jadi set OUTPUT di sini.
+        pinMode(RST_PIN, OUTPUT);
+        digitalWrite(RST_PIN, LOW);
+        delay(2);
+        digitalWrite(RST_PIN, HIGH);
+        delay(50);
+    }
+    mfrc522.PCD_Init();
+    Wire.end();
+    Wire.begin(33, 32);
+    oledRenderer.shadowValid = false; // Sinyal RST ikut lewat SDA, segarkan panel penuh
+}
+
+void resetRFIDModule() {
+    // Hard reset lewat pin RST, lalu konfigurasi ulang dari awal.
+    initRFIDOnSharedBus(true);
+    
+    // Reset authentication state
+    mfrc522.PCD_StopCrypto1();
+    
+    // Re-initialize key
+    for (byte i = 0; i < 6; i++) {
+        key.keyByte[i] = 0xFF;
+    }
+}
+
+// VersionReg 0x00/0xFF berarti chip tidak menjawab di SPI
+bool rfidReaderResponding() {
+    byte version = mfrc522.PCD_ReadRegister(MFRC522::VersionReg);
+    return version != 0x00 && version != 0xFF;
+}
+
+// Dipanggil task RFID saat MAX_SCAN_FAILURES tercapai. Jika reader masih tidak
+// menjawab setelah satu tier, tier berikutnya langsung dicoba.
+void recoverRFIDReader() {
+    if (recoveryStats.lastRecovery != 0 && millis() - recoveryStats.lastRecovery >= RECOVERY_LADDER_RESET) {
+        recoveryStats.nextTier = RECOVERY_STOP_CRYPTO;
+    }
+    recoveryStats.lastRecovery = millis();
+
+    stopFeedback(FEEDBACK_READING);
+
+    while (recoveryStats.nextTier < RECOVERY_RESTART) {
+        uint8_t tier = recoveryStats.nextTier++;
+        postOLEDStatus("RFID Recovery", RECOVERY_TIER_NAMES[tier]);
+        Serial.printf("RFID recovery tier %u (%s)\n", tier, RECOVERY_TIER_NAMES[tier]);
+
+        unsigned long start = millis();
+        switch (tier) {
+        case RECOVERY_STOP_CRYPTO:
+            mfrc522.PICC_HaltA();
+            mfrc522.PCD_StopCrypto1();
+            mfrc522.PCD_WriteRegister(MFRC522::CommandReg, MFRC522::PCD_Idle);
+            mfrc522.PCD_WriteRegister(MFRC522::ComIrqReg, 0x7F);
+            mfrc522.PCD_WriteRegister(MFRC522::FIFOLevelReg, 0x80);
+            break;
+        case RECOVERY_SOFT_RESET:
+            initRFIDOnSharedBus(false); // SoftReset lalu set ulang timer, modulasi & antena
+            break;
+        case RECOVERY_ANTENNA_CYCLE:
+            mfrc522.PCD_AntennaOff();
+            delay(ANTENNA_CYCLE_OFF_MS);
+            mfrc522.PCD_AntennaOn();
+            break;
+        case RECOVERY_REINIT:
+            resetRFIDModule();
+            break;
+        }
+        bool responding = rfidReaderResponding();
+        uint32_t downtime = millis() - start;
+
+        recoveryStats.attempts[tier]++;
+        recoveryStats.lastDowntimeMs[tier] = downtime;
+        recoveryStats.totalDowntimeMs[tier] += downtime;
+        Serial.printf("RFID recovery tier %u: %s, downtime %lu ms\n", tier, responding ? "reader OK" : "no response", (unsigned long)downtime);
+
+        if (responding) {
+            recoveryStats.healthy[tier]++;
+            return;
+        }
+    }
+
+    // Semua tier gagal: serahkan ke loop() untuk kirim journal & restart
+    recoveryStats.attempts[RECOVERY_RESTART]++;
+    rfidRestartRequested = true;
+}
+
+void setScanState(ScanState state) {
+    scanContext.state = state;
+    scanContext.stateStart = millis();
+}
+
+// Tier terakhir recoverRFIDReader(): kirim isi journal lalu restart.
+// Dijalankan dari loop() atas permintaan task RFID (rfidRestartRequested).
+void handleCriticalRFIDFailure() {
+    updateOLEDStatus("Critical Error", "Sending buffer...");
+    setLEDLevel(LED_RED, HIGH);
+    errorBeep();
+
+    // Simpan hasil scan yang masih di antrian sebelum restart
+    drainScanQueue();
+
+    // Beri task upload kesempatan mengirim isi journal. Yang belum terkirim
+    // tetap aman di journal dan dikirim setelah restart.
+    if (journal.pendingCount > 0) {
+        updateOLEDStatus("Sending Data", "Before restart...");
+
+        unsigned long start = millis();
+        while (journal.pendingCount > 0 && millis() - start < UPLOAD_FLUSH_TIMEOUT) {
+            sealUploadBatch();
+            delay(100);
+        }
+
+        if (journal.pendingCount == 0) {
+            updateOLEDStatus("Data Sent", "Restarting...");
+            successBeep();
+            blinkLED(LED_GREEN, 2, 200);
+        } else {
+            updateOLEDStatus("Send Failed", "Restarting...");
+            errorBeep();
+            blinkLED(LED_RED, 3, 200);
+        }
+    } else {
+        updateOLEDStatus("No Data", "Restarting...");
+    }
+
+    // Delay sebelum restart
+    delay(2000);
+    ESP.restart();
+}
+
+// Pembacaan blok gagal: beri feedback lalu tutup sesi kartu
+void failScan() {
+    if (scanContext.revalidating) {
+        // Scan sudah diterima dari cache; revalidasi diulang pada tap berikutnya
+        Serial.println("UID cache revalidation skipped (card removed?)");
+        setScanState(SCAN_HALT);
+        return;
+    }
+
+    scanContext.failureCount++;
+    playFeedback(FEEDBACK_WARNING);
+    scanFeedbackUntil = millis() + SCAN_FEEDBACK_DURATION;
+    postOLEDStatus("Read Failed", "Try again");
+    Serial.println("Failed to read card data");
+
+    if (scanContext.failureCount >= MAX_SCAN_FAILURES) {
+        scanContext.failureCount = 0;
+        recoverRFIDReader();
+    }
+    setScanState(SCAN_HALT);
+}
+
+// Menjalankan satu tahap pembacaan kartu lalu kembali ke rfidTask().
+// Latensi scan hanya ditentukan oleh protokol kartu, tanpa delay().
+void processRFIDCard() {
+    if (rfidScanBlocked()) {
+        if (scanContext.state == SCAN_IDLE) {
+            return;
+        }
+        if (scanContext.state != SCAN_ENQUEUE && scanContext.state != SCAN_HALT) {
+            // RFID dinonaktifkan di tengah sesi: batalkan sesi kartu.
+            // Record yang sudah lengkap (SCAN_ENQUEUE) tetap diantrikan.
+            mfrc522.PICC_HaltA();
+            mfrc522.PCD_StopCrypto1();
+            stopFeedback(FEEDBACK_READING);
+            setScanState(SCAN_IDLE);
+            return;
+        }
+    }
+
+    switch (scanContext.state) {
+    case SCAN_IDLE:
+        // Kembali ke status Ready setelah nama hasil scan selesai ditampilkan
+        if (scanFeedbackUntil != 0 && (long)(millis() - scanFeedbackUntil) >= 0) {
+            scanFeedbackUntil = 0;
+            char bufferText[24];
+            snprintf(bufferText, sizeof(bufferText), "Buffer: %lu", (unsigned long)pendingScanCount());
+            postOLEDStatus("Ready", bufferText);
+        }
+
+#if RFID_USE_IRQ
+        // Kartu sudah menjawab REQA dari waitForCardIRQ()
+        if (rfidCardSignalled) {
+            rfidCardSignalled = false;
+            setScanState(SCAN_SELECT);
+        }
+#else
+        if (mfrc522.PICC_IsNewCardPresent()) {
+            setScanState(SCAN_SELECT);
+        }
+#endif
+        break;
+
+    case SCAN_SELECT:
+        if (mfrc522.PICC_ReadCardSerial()) {
+            // Kartu yang sama baru saja tercatat: abaikan tanpa membaca blok.
+            // Kartu lain tetap langsung diterima.
+            scanContext.uidHash = hashUID(mfrc522.uid.uidByte, mfrc522.uid.size);
+            if (isDuplicateScan(scanContext.uidHash)) {
+                scanFeedbackUntil = millis() + SCAN_FEEDBACK_DURATION;
+                postOLEDStatus("Sudah Tercatat", "Scan diabaikan");
+                setScanState(SCAN_HALT);
+                break;
+            }
+
+            playFeedback(FEEDBACK_READING);
+
+            // Prepare RFID data structure
+            memset(&scanContext.record, 0, sizeof(scanContext.record));
+            stampCaptureTime(scanContext.record);
+
+            // Read UID
+            scanContext.record.uidLength = min(mfrc522.uid.size, (byte)sizeof(scanContext.record.uid));
+            memcpy(scanContext.record.uid, mfrc522.uid.uidByte, scanContext.record.uidLength);
+
+            // Kartu yang sudah dikenal langsung diantrikan dari cache tanpa
+            // autentikasi & baca blok; sesekali tetap dibaca untuk revalidasi
+            bool revalidate = false;
+            scanContext.fromCache = uidCacheLookup(mfrc522.uid.uidByte, mfrc522.uid.size, scanContext.record, revalidate);
+            scanContext.revalidating = scanContext.fromCache && revalidate;
+            scanContext.stepIndex = 0;
+
+            if (scanContext.fromCache) {
+                setScanState(SCAN_ENQUEUE);
+            } else {
+                postOLEDStatus("Reading Card", "Please wait...");
+                beginReadStep();
+            }
+        } else if (millis() - scanContext.stateStart >= READ_TIMEOUT) {
+            scanContext.failureCount++;
+            scanFeedbackUntil = millis() + SCAN_FEEDBACK_DURATION;
+            postOLEDStatus("Read Error", "Please try again");
+            playFeedback(FEEDBACK_ERROR);
+
+            if (scanContext.failureCount >= MAX_SCAN_FAILURES) {
+                scanContext.failureCount = 0;
+                recoverRFIDReader();
+            }
+            setScanState(SCAN_IDLE);
+        }
+        break;
+
+    case SCAN_AUTHENTICATE:
+        // Satu autentikasi berlaku untuk semua blok di sektor yang sama
+        status = mfrc522.PCD_Authenticate(MFRC522::PICC_CMD_MF_AUTH_KEY_A, cardReadPlan.steps[scanContext.stepIndex].block, &key, &(mfrc522.uid));
+        if (status == MFRC522::STATUS_OK) {
+            setScanState(SCAN_READ);
+        } else {
+            failScan();
+        }
+        break;
+
+    case SCAN_READ: {
+        const ReadStep &step = cardReadPlan.steps[scanContext.stepIndex];
+        if (!readRFIDBlock(step.block)) {
+            failScan();
+            break;
+        }
+        uint32_t elapsed = micros() - scanContext.stepStartMicros;
+
+        // Decode semua field yang ada di blok ini (NISN, NIP, Nama)
+        bool fieldsValid = true;
+        for (byte i = 0; i < CARD_FIELD_COUNT; i++) {
+            const CardField &field = CARD_LAYOUT[i];
+            if (field.block != step.block) continue;
+
+            char *value = scanContext.record.blockData[i];
+            decodeCardField(field, readBlockData, value, sizeof(scanContext.record.blockData[i]));
+            if (value[0] == '\0') {
+                fieldsValid = false;
+                break;
+            }
+            cardReadStats.lastFieldMicros[i] = elapsed;
+            Serial.printf("%s: %s\n", field.name, value);
+        }
+        if (!fieldsValid) {
+            failScan();
+            break;
+        }
+
+        scanContext.stepIndex++;
+        if (scanContext.stepIndex < cardReadPlan.count) {
+            beginReadStep();
+        } else {
+            cardReadStats.fullReads++;
+            for (byte i = 0; i < CARD_FIELD_COUNT; i++) {
+                cardReadStats.totalFieldMicros[i] += cardReadStats.lastFieldMicros[i];
+            }
+            reportCardReadStats();
+            setScanState(scanContext.revalidating ? SCAN_REVALIDATE : SCAN_ENQUEUE);
+        }
+        break;
+    }
+
+    case SCAN_ENQUEUE: {
+        RFIDData &newData = scanContext.record;
+
+        // Antrian penuh: loop() belum sempat memindahkan ke journal,
+        // coba lagi pada pemanggilan berikutnya
+        if (!scanQueue.push(newData)) {
+            if (scanContext.stallStart == 0) {
+                scanContext.stallStart = millis() | 1;
+                uploader.ringStalls++;
+            }
+            break;
+        }
+        if (scanContext.stallStart != 0) {
+            uploader.ringStallMs += millis() - scanContext.stallStart;
+            scanContext.stallStart = 0;
+        }
+        if (loopTaskHandle != nullptr) {
+            xTaskNotifyGive(loopTaskHandle);
+        }
+
+        // Reset failure count on success; reader sehat, tangga recovery mulai dari bawah
+        scanContext.failureCount = 0;
+        recoveryStats.nextTier = RECOVERY_STOP_CRYPTO;
+        rememberScan(scanContext.uidHash);
+
+        // Show the name that was just read (index 2 is Nama)
+        char displayName[17];
+        strlcpy(displayName, newData.blockData[2], sizeof(displayName));
+
+        // Display feedback sequence
+        playFeedback(FEEDBACK_SUCCESS);
+
+        // Nama ditampilkan sampai scanFeedbackUntil tanpa menahan task;
+        // diisi lebih dulu agar loop() tidak sempat mengirim layar idle
+        scanFeedbackUntil = millis() + SCAN_FEEDBACK_DURATION;
+        postOLEDStatus("Berhasil Scan", displayName);
+        Serial.printf("Card read successful. Buffer count: %lu\n", (unsigned long)pendingScanCount());
+
+        // Additional debug info
+        char uidHex[sizeof(newData.uid) * 2 + 1];
+        formatUID(newData, uidHex, sizeof(uidHex));
+        Serial.printf("UID: %s\n", uidHex);
+        Serial.printf("NISN: %s\n", newData.blockData[0]);
+        Serial.printf("NIP: %s\n", newData.blockData[1]);
+        Serial.printf("Nama: %s\n", newData.blockData[2]);
+
+        if (!scanContext.fromCache) {
+            uidCacheStore(mfrc522.uid.uidByte, mfrc522.uid.size, newData);
+        }
+
+        if (scanContext.revalidating) {
+            // Scan sudah tercatat; baca isi kartu untuk memeriksa cache
+            scanContext.stepIndex = 0;
+            beginReadStep();
+        } else {
+            setScanState(SCAN_HALT);
+        }
+        break;
+    }
+
+    case SCAN_REVALIDATE:
+        if (uidCacheStore(mfrc522.uid.uidByte, mfrc522.uid.size, scanContext.record)) {
+            Serial.println("UID cache updated: card data changed");
+        }
+        setScanState(SCAN_HALT);
+        break;
+
+    case SCAN_HALT:
+        stopFeedback(FEEDBACK_READING);
+
+        // Always properly close the current card operation
+        mfrc522.PICC_HaltA();
+        mfrc522.PCD_StopCrypto1();
+        setScanState(SCAN_IDLE);
+        break;
+    }
+}
+
+const char BATCH_PAYLOAD_PREFIX[] = "{\"command\":\"insert_rows\",\"sheet_name\":\"LOG_Attendance\",\"values\":[";
+const char BATCH_PAYLOAD_SUFFIX[] = "],\"device\":\"%s\",\"batch_id\":\"%s\"}";
+
+const char *deviceId() {
+    static char id[13] = "";
+    if (id[0] == '\0') {
+        uint64_t mac = ESP.getEfuseMac();
+        snprintf(id, sizeof(id), "%04X%08lX", (unsigned)(mac >> 32), (unsigned long)(mac & 0xFFFFFFFF));
+    }
+    return id;
+}
+
+// Tulis satu string JSON ke out: karakter non-printable dibuang, kutip dan
+// backslash di-escape. Field sudah di-trim saat decodeCardField(). out harus
+// muat 2 + 2 x panjang value.
+size_t appendJsonField(char *out, const char *value) {
+    size_t length = 0;
+    out[length++] = '"';
+    for (const char *c = value; *c != '\0'; c++) {
+        if (*c < 32 || *c > 126) continue;
+        if (*c == '"' || *c == '\\') out[length++] = '\\';
+        out[length++] = *c;
+    }
+    out[length++] = '"';
+    return length;
+}
+
+size_t renderBatchRow(const RFIDData &data, const ClockSnapshot &clock, bool first, char *out) {
+    size_t length = 0;
+    if (!first) out[length++] = ',';
+
+    // Data array untuk satu baris: [NISN, NIP, Nama, sequence, waktu scan]
+    out[length++] = '[';
+    for (byte i = 0; i < 3; i++) {
+        if (i > 0) out[length++] = ',';
+        length += appendJsonField(out + length, data.blockData[i]);
+    }
+    length += sprintf(out + length, ",%lu,%lu]", (unsigned long)data.sequence, (unsigned long)resolveCaptureTime(data, clock));
+    out[length] = '\0';
+    return length;
+}
+
+size_t appendCsvField(char *out, const char *value) {
+    bool quoted = strpbrk(value, ",\"") != nullptr;
+    size_t length = 0;
+    if (quoted) out[length++] = '"';
+    for (const char *c = value; *c != '\0'; c++) {
+        if (*c < 32 || *c > 126) continue;
+        if (*c == '"') out[length++] = '"';
+        out[length++] = *c;
+    }
+    if (quoted) out[length++] = '"';
+    return length;
+}
+
+size_t renderBatchRowCsv(const RFIDData &data, const ClockSnapshot &clock, char *out) {
+    size_t length = 0;
+    for (byte i = 0; i < 3; i++) {
+        if (i > 0) out[length++] = ',';
+        length += appendCsvField(out + length, data.blockData[i]);
+    }
+    length += sprintf(out + length, ",%lu,%lu\n", (unsigned long)data.sequence, (unsigned long)resolveCaptureTime(data, clock));
+    return length;
+}
+
+#ifdef BATCH_FORMAT_BENCHMARK
+// Encode MAX_BATCH_SIZE record contoh dengan setiap format (polos & gzip) dan
+// cetak jumlah byte di wire serta waktu encode. Tidak menyentuh journal
+// maupun jaringan.
+void benchmarkBatchFormats() {
+    const char *const names[] = {"Ahmad Fauzi", "Siti Nurhaliza", "Budi Santoso, S.Pd", "Dewi \"Ayu\" Lestari", "Muhammad Rizky"};
+    static GzipEncoder jsonEncoder;
+    static GzipEncoder csvEncoder;
+    static uint8_t packed[DEFLATE_OUT_MAX(BATCH_ROW_MAX + 1)];
+    ClockSnapshot clock = clockSnapshot();
+    RFIDData sample;
+    char row[BATCH_ROW_MAX + 1];
+    size_t jsonBytes = 0;
+    size_t csvBytes = 0;
+    size_t jsonGzipBytes = 0;
+    size_t csvGzipBytes = 0;
+    uint32_t jsonMicros = 0;
+    uint32_t csvMicros = 0;
+    uint32_t jsonGzipMicros = 0;
+    uint32_t csvGzipMicros = 0;
+
+    jsonEncoder.begin();
+    csvEncoder.begin();
+    size_t length = strlcpy(row, BATCH_PAYLOAD_PREFIX, sizeof(row));
+    jsonBytes += length;
+    jsonGzipBytes += jsonEncoder.write((const uint8_t *)row, length, packed);
+
+    for (int i = 0; i < MAX_BATCH_SIZE; i++) {
+        memset(&sample, 0, sizeof(sample));
+        sample.uidLength = 4;
+        sample.sequence = i + 1;
+        sample.captureTime = 1760000000 + i * 7;
+        bool teacher = i % 10 == 0;
+        snprintf(sample.blockData[teacher ? 1 : 0], sizeof(sample.blockData[0]), teacher ? "1987%012d" : "00%08d", i);
+        strlcpy(sample.blockData[2], names[i % 5], sizeof(sample.blockData[2]));
+
+        uint32_t start = micros();
+        length = renderBatchRow(sample, clock, i == 0, row);
+        jsonMicros += micros() - start;
+        jsonBytes += length;
+        start = micros();
+        jsonGzipBytes += jsonEncoder.write((const uint8_t *)row, length, packed);
+        jsonGzipMicros += micros() - start;
+
+        start = micros();
+        length = renderBatchRowCsv(sample, clock, row);
+        csvMicros += micros() - start;
+        csvBytes += length;
+        start = micros();
+        csvGzipBytes += csvEncoder.write((const uint8_t *)row, length, packed);
+        csvGzipMicros += micros() - start;
+    }
+
+    length = snprintf(row, sizeof(row), BATCH_PAYLOAD_SUFFIX, deviceId(), "000000000000-1-100");
+    jsonBytes += length;
+    jsonGzipBytes += jsonEncoder.write((const uint8_t *)row, length, packed);
+    jsonGzipBytes += jsonEncoder.finish(packed);
+    csvGzipBytes += csvEncoder.finish(packed);
+
+    Serial.printf("Batch format benchmark (%d rows):\n", MAX_BATCH_SIZE);
+    Serial.printf("  json:      %u bytes, %lu us\n", (unsigned)jsonBytes, (unsigned long)jsonMicros);
+    Serial.printf("  json+gzip: %u bytes, +%lu us (%u%% of json)\n", (unsigned)jsonGzipBytes, (unsigned long)jsonGzipMicros,
+                  (unsigned)(jsonGzipBytes * 100 / jsonBytes));
+    Serial.printf("  csv1:      %u bytes, %lu us (%u%% of json)\n", (unsigned)csvBytes, (unsigned long)csvMicros,
+                  (unsigned)(csvBytes * 100 / jsonBytes));
+    Serial.printf("  csv1+gzip: %u bytes, +%lu us (%u%% of json)\n", (unsigned)csvGzipBytes, (unsigned long)csvGzipMicros,
+                  (unsigned)(csvGzipBytes * 100 / jsonBytes));
+}
+#endif
+
+void formatUID(const RFIDData &data, char *out, size_t outSize) {
+    size_t pos = 0;
+    for (byte i = 0; i < data.uidLength && pos + 2 < outSize; i++) {
+        snprintf(out + pos, outSize - pos, "%02x", data.uid[i]);
+        pos += 2;
+    }
+    out[pos] = '\0';
+}
+
+// Tabel panjang & jarak deflate (RFC 1951 3.2.5)
+const uint16_t DEFLATE_LENGTH_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                          35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t DEFLATE_LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                          3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t DEFLATE_DISTANCE_BASE[20] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769};
+const uint8_t DEFLATE_DISTANCE_EXTRA[20] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8};
+static_assert(DEFLATE_WINDOW <= 1024, "Tabel jarak hanya sampai 1024");
+
+void GzipEncoder::begin() {
+    historyLength = 0;
+    memset(hashHead, 0, sizeof(hashHead));
+    bitBuffer = 0;
+    bitCount = 0;
+    crc = 0xFFFFFFFF;
+    inputLength = 0;
+    headerPending = true;
+    done = false;
+}
+
+void GzipEncoder::putBits(uint32_t value, uint8_t count) {
+    bitBuffer |= value << bitCount;
+    bitCount += count;
+    while (bitCount >= 8) {
+        out[outLength++] = (uint8_t)bitBuffer;
+        bitBuffer >>= 8;
+        bitCount -= 8;
+    }
+}
+
+void GzipEncoder::putCode(uint16_t code, uint8_t length) {
+    uint16_t reversed = 0;
+    for (uint8_t i = 0; i < length; i++) {
+        reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    putBits(reversed, length);
+}
+
+void GzipEncoder::putSymbol(uint16_t symbol) {
+    if (symbol < 144) putCode(0x30 + symbol, 8);
+    else if (symbol < 256) putCode(0x190 + symbol - 144, 9);
+    else if (symbol < 280) putCode(symbol - 256, 7);
+    else putCode(0xC0 + symbol - 280, 8);
+}
+
+void GzipEncoder::putMatch(uint16_t length, uint16_t distance) {
+    uint8_t code = 28;
+    while (DEFLATE_LENGTH_BASE[code] > length) code--;
+    putSymbol(257 + code);
+    putBits(length - DEFLATE_LENGTH_BASE[code], DEFLATE_LENGTH_EXTRA[code]);
+
+    code = 19;
+    while (DEFLATE_DISTANCE_BASE[code] > distance) code--;
+    putCode(code, 5);
+    putBits(distance - DEFLATE_DISTANCE_BASE[code], DEFLATE_DISTANCE_EXTRA[code]);
+}
+
+// Header gzip (tanpa nama & mtime agar hasil selalu sama), lalu satu blok
+// Huffman tetap yang sekaligus blok terakhir
+void GzipEncoder::putHeader() {
+    static const uint8_t header[10] = {0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF};
+    memcpy(out + outLength, header, sizeof(header));
+    outLength += sizeof(header);
+    putBits(1, 1); // BFINAL
+    putBits(1, 2); // BTYPE 01
+    headerPending = false;
+}
+
+uint16_t GzipEncoder::hashAt(size_t pos) const {
+    uint32_t value = (uint32_t)history[pos] << 16 | (uint32_t)history[pos + 1] << 8 | history[pos + 2];
+    return (value * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+// length maksimal DEFLATE_WINDOW; out harus muat DEFLATE_OUT_MAX(length)
+size_t GzipEncoder::write(const uint8_t *data, size_t length, uint8_t *output) {
+    out = output;
+    outLength = 0;
+    if (headerPending) putHeader();
+
+    crc = crc32Update(crc, data, length);
+    inputLength += length;
+
+    // History penuh: simpan DEFLATE_WINDOW byte terakhir sebagai jendela match
+    if (historyLength + length > sizeof(history)) {
+        size_t shift = historyLength - DEFLATE_WINDOW;
+        memmove(history, history + shift, DEFLATE_WINDOW);
+        historyLength = DEFLATE_WINDOW;
+        for (auto &head : hashHead) {
+            head = head > shift ? head - shift : 0;
+        }
+    }
+    memcpy(history + historyLength, data, length);
+    size_t pos = historyLength;
+    size_t end = historyLength + length;
+    historyLength = end;
+
+    while (pos < end) {
+        size_t best = 0;
+        size_t distance = 0;
+        if (end - pos >= DEFLATE_MIN_MATCH) {
+            uint16_t hash = hashAt(pos);
+            size_t candidate = hashHead[hash];
+            hashHead[hash] = pos + 1;
+            if (candidate != 0 && pos - (candidate - 1) <= DEFLATE_WINDOW) {
+                candidate--;
+                size_t limit = min(end - pos, (size_t)DEFLATE_MAX_MATCH);
+                while (best < limit && history[candidate + best] == history[pos + best]) best++;
+                distance = pos - candidate;
+            }
+        }
+
+        if (best >= DEFLATE_MIN_MATCH) {
+            putMatch(best, distance);
+            // Posisi di dalam match tetap dimasukkan ke hash untuk match berikutnya
+            for (size_t next = pos + 1; next < pos + best && next + DEFLATE_MIN_MATCH <= end; next++) {
+                hashHead[hashAt(next)] = next + 1;
+            }
+            pos += best;
+        } else {
+            putSymbol(history[pos]);
+            pos++;
+        }
+    }
+    return outLength;
+}
+
+size_t GzipEncoder::finish(uint8_t *output) {
+    out = output;
+    outLength = 0;
+    if (headerPending) putHeader();
+
+    putSymbol(256); // Akhir blok
+    if (bitCount > 0) putBits(0, 8 - bitCount);
+
+    // Trailer: CRC-32 lalu panjang input, little-endian
+    uint32_t trailer[2] = {~crc, inputLength};
+    memcpy(out + outLength, trailer, sizeof(trailer));
+    outLength += sizeof(trailer);
+    done = true;
+    return outLength;
+}
+
+size_t BatchPayloadStream::begin(const UploadBatch &source, BatchFormat payloadFormat, bool gzipPayload) {
+    batch = source;
+    format = payloadFormat;
+    gzip = gzipPayload;
+    clock = clockSnapshot(); // Dipakai semua pass, termasuk retry
+
+    // Dry run: render seluruh payload sekali untuk menghitung panjangnya dan
+    // rentang sequence yang menjadi batch_id
+    total = 0;
+    rewind();
+    size_t length = 0;
+    firstSequence = 0;
+    lastSequence = 0;
+    key[0] = '\0';
+    while (fill()) {
+        length += chunkLength;
+    }
+
+    total = length;
+    plainTotal = plainRendered;
+    rewind();
+    return total;
+}
+
+void BatchPayloadStream::rewind() {
+    cursor = batch.from;
+    recordsLoaded = 0;
+    windowCount = 0;
+    windowIndex = 0;
+    chunkLength = 0;
+    chunkPos = 0;
+    phase = 0;
+    firstRow = true;
+    remaining = total;
+    plainRendered = 0;
+    if (gzip) {
+        encoder.begin();
+    }
+}
+
+bool BatchPayloadStream::fill() {
+    chunkLength = 0;
+    chunkPos = 0;
+
+    while (chunkLength == 0) {
+        if (phase == 3) {
+            // Semua bagian sudah di-render; gzip masih perlu ditutup
+            if (!gzip || encoder.finished()) return false;
+            chunkLength = encoder.finish((uint8_t *)chunk);
+        } else if (gzip) {
+            size_t length = renderNext(plain);
+            plainRendered += length;
+            chunkLength = length > 0 ? encoder.write((const uint8_t *)plain, length, (uint8_t *)chunk) : 0;
+        } else {
+            chunkLength = renderNext(chunk);
+            plainRendered += chunkLength;
+        }
+    }
+    return true;
+}
+
+// Satu langkah render ke out (kapasitas BATCH_ROW_MAX + 1). Return 0 bila
+// langkah ini tidak menghasilkan teks (baris dilewati, CSV tanpa pembungkus).
+size_t BatchPayloadStream::renderNext(char *out) {
+    const size_t outSize = BATCH_ROW_MAX + 1;
+    size_t length = 0;
+
+    switch (phase) {
+    case 0:
+        // CSV tidak punya pembungkus; perintah dikirim di URL
+        if (format == BATCH_FORMAT_JSON) {
+            length = strlcpy(out, BATCH_PAYLOAD_PREFIX, outSize);
+        }
+        phase = 1;
+        break;
+
+    case 1: {
+        if (windowIndex >= windowCount) {
+            int wanted = min(BATCH_STREAM_WINDOW, batch.count - recordsLoaded);
+            JournalCursor next;
+            windowCount = wanted > 0 ? journalPeek(cursor, window, wanted, next) : 0;
+            windowIndex = 0;
+            if (windowCount == 0) {
+                phase = 2;
+                break;
+            }
+            cursor = next;
+            recordsLoaded += windowCount;
+        }
+
+        // Frame rusak dan baris yang sudah di-ack server dilewati
+        const RFIDData &row = window[windowIndex++];
+        if (row.uidLength == 0 || sequenceAcknowledged(batch, row.sequence)) break;
+        if (key[0] == '\0') {
+            if (firstSequence == 0) firstSequence = row.sequence;
+            lastSequence = row.sequence;
+        }
+        length = format == BATCH_FORMAT_CSV ? renderBatchRowCsv(row, clock, out) : renderBatchRow(row, clock, firstRow, out);
+        firstRow = false;
+        break;
+    }
+
+    case 2:
+        if (key[0] == '\0') {
+            // Tidak ada baris yang bisa di-decode: pakai posisi journal
+            if (firstSequence != 0) {
+                snprintf(key, sizeof(key), "%s-%lu-%lu", deviceId(), (unsigned long)firstSequence, (unsigned long)lastSequence);
+            } else {
+                snprintf(key, sizeof(key), "%s-j%lu.%lu", deviceId(), (unsigned long)batch.from.segment, (unsigned long)batch.from.offset);
+            }
+        }
+        if (format == BATCH_FORMAT_JSON) {
+            length = snprintf(out, outSize, BATCH_PAYLOAD_SUFFIX, deviceId(), key);
+        }
+        phase = 3;
+        break;
+    }
+    return length;
+}
+
+int BatchPayloadStream::available() {
+    return (int)remaining;
+}
+
+int BatchPayloadStream::read() {
+    int c = peek();
+    if (c >= 0) {
+        chunkPos++;
+        if (remaining > 0) remaining--;
+    }
+    return c;
+}
+
+int BatchPayloadStream::peek() {
+    if (chunkPos >= chunkLength && !fill()) {
+        return -1;
+    }
+    return (uint8_t)chunk[chunkPos];
+}
+
+void BatchAckReader::reset() {
+    mode = MODE_START;
+    text[0] = '\0';
+    textLength = 0;
+    key[0] = '\0';
+    inString = false;
+    escaped = false;
+    complete = false;
+    depth = 0;
+    list = 0;
+    sawAckList = false;
+    number = 0;
+    haveNumber = false;
+    rangeLength = 0;
+    acceptedCount = 0;
+    rejectedCount = 0;
+    rejected = 0;
+    bytes = 0;
+}
+
+bool BatchAckReader::valid() const {
+    if (mode == MODE_TEXT) return strncmp(text, "Success", 7) == 0;
+    return mode == MODE_JSON && complete && sawAckList;
+}
+
+uint32_t BatchAckReader::acceptedRows() const {
+    if (mode == MODE_TEXT) {
+        const char *count = strrchr(text, ' ');
+        return count ? strtoul(count + 1, nullptr, 10) : 0;
+    }
+    uint32_t rows = 0;
+    for (uint8_t i = 0; i < acceptedCount; i++) {
+        if (accepted[i].last >= accepted[i].first) rows += accepted[i].last - accepted[i].first + 1;
+    }
+    return rows;
+}
+
+// Tokenizer JSON minimal: hanya melacak kedalaman, key level atas, dan
+// angka di dalam [[a,b],...] milik "accepted" / "rejected"
+size_t BatchAckReader::write(uint8_t c) {
+    if (bytes++ >= ACK_MAX_BYTES) return 1;
+
+    if (mode == MODE_START) {
+        if (isspace(c)) return 1;
+        mode = c == '{' ? MODE_JSON : MODE_TEXT;
+    }
+    if (mode == MODE_TEXT || inString) {
+        if (inString && escaped) {
+            escaped = false;
+        } else if (inString && c == '\\') {
+            escaped = true;
+            return 1;
+        } else if (inString && c == '"') {
+            inString = false;
+            return 1;
+        }
+        if (textLength < sizeof(text) - 1) {
+            text[textLength++] = c;
+            text[textLength] = '\0';
+        }
+        return 1;
+    }
+
+    switch (c) {
+    case '"':
+        inString = true;
+        textLength = 0;
+        text[0] = '\0';
+        break;
+    case ':':
+        if (depth == 1) strlcpy(key, text, sizeof(key));
+        break;
+    case '{':
+        depth++;
+        break;
+    case '[':
+        depth++;
+        if (depth == 2) {
+            list = strcmp(key, "accepted") == 0 ? 1 : strcmp(key, "rejected") == 0 ? 2 : 0;
+            if (list != 0) sawAckList = true;
+        }
+        rangeLength = 0;
+        break;
+    case ',':
+        endNumber();
+        break;
+    case ']':
+        endNumber();
+        if (depth == 3) endRange();
+        if (depth > 0) depth--;
+        if (depth < 2) list = 0;
+        break;
+    case '}':
+        endNumber();
+        if (depth > 0) depth--;
+        if (depth == 0) complete = true;
+        break;
+    default:
+        if (c >= '0' && c <= '9') {
+            number = number * 10 + (c - '0');
+            haveNumber = true;
+        }
+        break;
+    }
+    return 1;
+}
+
+void BatchAckReader::endNumber() {
+    if (haveNumber && depth == 3 && list != 0 && rangeLength < 2) {
+        range[rangeLength++] = number;
+    }
+    number = 0;
+    haveNumber = false;
+}
+
+void BatchAckReader::endRange() {
+    if (rangeLength == 0 || list == 0) return;
+    SequenceRange parsed = {range[0], rangeLength > 1 ? range[1] : range[0]};
+    rangeLength = 0;
+
+    if (list == 2) {
+        if (parsed.last >= parsed.first) rejected += parsed.last - parsed.first + 1;
+        if (rejectedCount < ACK_MAX_RANGES) rejectedRanges[rejectedCount++] = parsed;
+    } else if (acceptedCount < ACK_MAX_RANGES) {
+        accepted[acceptedCount++] = parsed;
+    }
+}
+
+bool BatchAckReader::sequenceRejected(uint32_t sequence) const {
+    for (uint8_t i = 0; sequence != 0 && i < rejectedCount; i++) {
+        if (sequence >= rejectedRanges[i].first && sequence <= rejectedRanges[i].last) return true;
+    }
+    return false;
+}
+
+void commitUploadBatch(const UploadBatch &batch) {
+    JournalLock lock;
+    journalCommit(batch.next, batch.count);
+    uploader.sealedRecords = (uint32_t)batch.count > uploader.sealedRecords ? 0 : uploader.sealedRecords - batch.count;
+}
+
+// Dipanggil dari loop(). Min free heap adalah high-water mark pemakaian heap
+// sejak boot; blok bebas terbesar yang terus mengecil menandakan fragmentasi.
+void reportHeapUsage() {
+    if (millis() - lastHeapReport < HEAP_REPORT_INTERVAL) return;
+    lastHeapReport = millis();
+
+    Serial.printf("Heap: free %lu, min free %lu, largest block %lu, RFID task stack free %lu\n",
+                  (unsigned long)ESP.getFreeHeap(), (unsigned long)ESP.getMinFreeHeap(),
+                  (unsigned long)ESP.getMaxAllocHeap(),
+                  rfidTaskHandle ? (unsigned long)uxTaskGetStackHighWaterMark(rfidTaskHandle) : 0UL);
+    Serial.printf("OLED: %lu B/s, %lu frame (%lu identik dilewati), %lu page, %lu I2C error\n",
+                  (unsigned long)oledRenderer.bytesPerSecond, (unsigned long)oledRenderer.frames,
+                  (unsigned long)oledRenderer.skippedFrames, (unsigned long)oledRenderer.pagesSent,
+                  (unsigned long)oledRenderer.i2cErrors);
+}
+
+
+
+// Function to be called in main loop
+// Mengatur izin scan untuk task RFID; pembacaan kartu sendiri ada di rfidTask()
+void handleRFID()
+{
+    // WiFi putus atau GScript offline tidak menghentikan scan: record
+    // menunggu di journal sampai bisa dikirim
+
+    // Scan hanya diterima selama journal masih punya ruang
+    if (journalIsFull()) {
+        if (rfidAcceptingScans) {
+            postOLEDStatus("Buffer Full", "Please wait...");
+        }
+        if (uploader.admissionStallStart == 0) {
+            uploader.admissionStallStart = millis() | 1;
+            uploader.admissionStalls++;
+        }
+        rfidAcceptingScans = false;
+        return;
+    }
+
+    if (uploader.admissionStallStart != 0) {
+        uploader.admissionStallMs += millis() - uploader.admissionStallStart;
+        uploader.admissionStallStart = 0;
+    }
+    rfidAcceptingScans = true;
+}
+
+// =========================
+// ======= JOURNAL FUNCTIONS =======
+// =========================
+
+const uint16_t JOURNAL_RECORD_MAGIC = 0xA7E2;    // Payload: RFIDData apa adanya
+const uint32_t JOURNAL_CURSOR_MAGIC = 0x4A435552; // "JCUR"
+
+// CRC-32 (IEEE) bertahap: mulai dari 0xFFFFFFFF, invert hasil akhirnya
+uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        crc ^= data[i];
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return crc;
+}
+
+// CRC-32 (IEEE) untuk framing record dan cursor
+uint32_t journalCrc32(const uint8_t *data, size_t length)
+{
+    return ~crc32Update(0xFFFFFFFF, data, length);
+}
+
+static String journalSegmentPath(uint32_t segment)
+{
+    char path[32];
+    snprintf(path, sizeof(path), JOURNAL_DIR "/%08lu.seg", (unsigned long)segment);
+    return String(path);
+}
+
+static String journalCursorPath(uint32_t generation)
+{
+    // Dua slot bergantian: cursor.0 dan cursor.1
+    return String(JOURNAL_DIR "/cursor.") + String(generation % 2);
+}
+
+// Frame JOURNAL_RECORD_MAGIC menyimpan RFIDData apa adanya (memcpy)
+static bool journalDecode(const uint8_t *payload, size_t length, RFIDData &data)
+{
+    memset(&data, 0, sizeof(data));
+    if (length != sizeof(RFIDData)) return false;
+
+    memcpy(&data, payload, length);
+    data.uidLength = min(data.uidLength, (uint8_t)sizeof(data.uid));
+    for (auto &field : data.blockData)
+    {
+        field[sizeof(field) - 1] = '\0';
+    }
+    return true;
+}
+
+// Membaca satu record dari posisi file saat ini.
+// Return false jika EOF atau frame rusak (misalnya tulisan terpotong).
+static bool journalReadFrame(File &file, uint8_t *payload, uint16_t &length)
+{
+    JournalFrameHeader header;
+    if (file.read((uint8_t *)&header, sizeof(header)) != sizeof(header)) return false;
+    if (header.magic != JOURNAL_RECORD_MAGIC) return false;
+    if (header.length == 0 || header.length > JOURNAL_MAX_PAYLOAD) return false;
+    if (file.read(payload, header.length) != header.length) return false;
+    if (journalCrc32(payload, header.length) != header.crc) return false;
+
+    length = header.length;
+    return true;
+}
+
+static bool journalSaveCursor()
+{
+    JournalCursorRecord record;
+    record.magic = JOURNAL_CURSOR_MAGIC;
+    record.generation = journal.cursorGeneration + 1;
+    record.head = journal.head;
+    record.tailSegment = journal.tail.segment;
+    record.nextSequence = journal.nextSequence;
+    record.crc = journalCrc32((const uint8_t *)&record, offsetof(JournalCursorRecord, crc));
+
+    File file = LittleFS.open(journalCursorPath(record.generation), "w");
+    if (!file) return false;
+    bool ok = file.write((const uint8_t *)&record, sizeof(record)) == sizeof(record);
+    file.close();
+
+    if (ok) journal.cursorGeneration = record.generation;
+    return ok;
+}
+
+static bool journalLoadCursor(JournalCursorRecord &best)
+{
+    bool found = false;
+    for (uint32_t slot = 0; slot < 2; slot++)
+    {
+        String path = journalCursorPath(slot);
+        if (!LittleFS.exists(path)) continue;
+
+        File file = LittleFS.open(path, "r");
+        if (!file) continue;
+        JournalCursorRecord record;
+        size_t n = file.read((uint8_t *)&record, sizeof(record));
+        file.close();
+
+        if (n != sizeof(record) || record.magic != JOURNAL_CURSOR_MAGIC) continue;
+        if (journalCrc32((const uint8_t *)&record, offsetof(JournalCursorRecord, crc)) != record.crc) continue;
+
+        if (!found || record.generation > best.generation)
+        {
+            best = record;
+            found = true;
+        }
+    }
+    return found;
+}
+
+bool initJournal()
+{
+    if (!LittleFS.begin(true))
+    {
+        Serial.println("LittleFS mount failed");
+        return false;
+    }
+    if (!LittleFS.exists(JOURNAL_DIR))
+    {
+        LittleFS.mkdir(JOURNAL_DIR);
+    }
+
+    // Cari rentang segmen yang ada di flash
+    uint32_t minSegment = 0;
+    uint32_t maxSegment = 0;
+    File dir = LittleFS.open(JOURNAL_DIR);
+    File entry = dir.openNextFile();
+    while (entry)
+    {
+        String name = entry.name();
+        name = name.substring(name.lastIndexOf('/') + 1);
+        if (name.endsWith(".seg"))
+        {
+            uint32_t segment = strtoul(name.c_str(), nullptr, 10);
+            if (segment > 0)
+            {
+                if (minSegment == 0 || segment < minSegment) minSegment = segment;
+                if (segment > maxSegment) maxSegment = segment;
             }
+        }
+        entry.close();
+        entry = dir.openNextFile();
+    }
+    dir.close();
 
-            // Display feedback sequence
-            blinkLED(LED_GREEN, 1, 100);
-            beep(1, 100);
-            
-            // Show name briefly
-            updateOLEDStatus("Berhasil Scan", displayName);
-            delay(1000);
-            
-            // Show buffer status
-            updateOLEDStatus("Ready", "Buffer: " + String(rfidBuffer.count));
-            Serial.println("Card read successful. Buffer count: " + String(rfidBuffer.count));
-
-            // Additional debug info
-            Serial.println("NISN: " + newData.blockData[0]);
-            Serial.println("NIP: " + newData.blockData[1]);
-            Serial.println("Nama: " + newData.blockData[2]);
-        } else {
-            // Buffer full
-            blinkLED(LED_RED, 2, 100);
-            beep(2, 100);
-            updateOLEDStatus("Buffer Full!", "Please wait...");
-            Serial.println("Buffer full - cannot add new data");
-            
-            // Try to send buffer immediately if full
-            String batchData = prepareDataForBatch();
-            if (!batchData.isEmpty()) {
-                if (sendBatchToGScript(batchData)) {
-                    updateOLEDStatus("Buffer Sent", "Scan Again");
-                    successBeep();
-                    blinkLED(LED_GREEN, 2, 200);
-                }
+    uint32_t tailSegment;
+    JournalCursorRecord saved;
+    if (journalLoadCursor(saved))
+    {
+        journal.head = saved.head;
+        journal.cursorGeneration = saved.generation;
+        journal.nextSequence = max(saved.nextSequence, (uint32_t)1);
+        tailSegment = max(saved.tailSegment, maxSegment);
+    }
+    else
+    {
+        journal.head = {minSegment > 0 ? minSegment : 1, 0};
+        tailSegment = maxSegment > 0 ? maxSegment : journal.head.segment;
+    }
+    if (tailSegment < journal.head.segment)
+    {
+        tailSegment = journal.head.segment;
+    }
+
+    // Segmen yang sudah terkirim tapi belum sempat dihapus sebelum reboot
+    for (uint32_t segment = minSegment; segment > 0 && segment < journal.head.segment; segment++)
+    {
+        LittleFS.remove(journalSegmentPath(segment));
+    }
+
+    // Hitung record yang belum terkirim dan cari posisi akhir tail. Record
+    // yang ditulis setelah cursor terakhir disimpan bisa punya sequence di
+    // atas nextSequence tersimpan, jadi sequence tertinggi ikut dicari.
+    uint8_t payload[JOURNAL_MAX_PAYLOAD];
+    RFIDData record;
+    journal.pendingCount = 0;
+    journal.tail = {tailSegment, 0};
+    for (uint32_t segment = journal.head.segment; segment <= tailSegment; segment++)
+    {
+        String path = journalSegmentPath(segment);
+        if (!LittleFS.exists(path)) continue;
+
+        File file = LittleFS.open(path, "r");
+        if (!file) continue;
+
+        uint32_t offset = (segment == journal.head.segment) ? journal.head.offset : 0;
+        file.seek(offset);
+        uint16_t length;
+        while (journalReadFrame(file, payload, length))
+        {
+            journal.pendingCount++;
+            if (journalDecode(payload, length, record) && record.sequence >= journal.nextSequence)
+            {
+                journal.nextSequence = record.sequence + 1;
             }
+            offset += sizeof(JournalFrameHeader) + length;
         }
-    } else {
-        // Read failed
-        blinkLED(LED_RED, 2, 200);
-        beep(2, 200);
-        updateOLEDStatus("Read Failed", "Try again");
-        Serial.println("Failed to read card data");
-        
-        // Cek threshold kegagalan
-        if (failureCount >= MAX_FAILURES) {
-            // Update OLED
-            updateOLEDStatus("Critical Error", "Sending buffer...");
-            digitalWrite(LED_RED, HIGH);
-            errorBeep();
-            
-            // Kirim data yang ada di buffer
-            if (rfidBuffer.count > 0) {
-                String batchData = prepareDataForBatch();
-                if (!batchData.isEmpty()) {
-                    updateOLEDStatus("Sending Data", "Before restart...");
-                    
-                    if (sendBatchToGScript(batchData)) {
-                        updateOLEDStatus("Data Sent", "Restarting...");
-                        successBeep();
-                        blinkLED(LED_GREEN, 2, 200);
-                    } else {
-                        updateOLEDStatus("Send Failed", "Restarting...");
-                        errorBeep();
-                        blinkLED(LED_RED, 3, 200);
-                    }
-                }
-            } else {
-                updateOLEDStatus("No Data", "Restarting...");
+
+        if (segment == tailSegment)
+        {
+            if (offset == file.size())
+            {
+                journal.tail.offset = offset;
             }
-            
-            delay(2000);
-            ESP.restart();
+            else
+            {
+                // Ada tulisan terpotong di akhir segmen: mulai segmen baru,
+                // sisa frame rusak akan dilewati oleh pembaca
+                journal.tail = {segment + 1, 0};
+            }
+        }
+        file.close();
+    }
+
+    journal.mounted = true;
+    journalSaveCursor();
+
+    Serial.printf("Journal ready: %lu pending, next seq %lu, head %lu:%lu, tail %lu:%lu\n",
+                  (unsigned long)journal.pendingCount, (unsigned long)journal.nextSequence,
+                  (unsigned long)journal.head.segment, (unsigned long)journal.head.offset,
+                  (unsigned long)journal.tail.segment, (unsigned long)journal.tail.offset);
+    return true;
+}
+
+bool journalIsFull()
+{
+    JournalLock lock;
+    if (!journal.mounted) return true;
+
+    size_t worstFrame = sizeof(JournalFrameHeader) + JOURNAL_MAX_PAYLOAD;
+    bool needsNewSegment = journal.tail.offset + worstFrame > JOURNAL_SEGMENT_SIZE;
+    if (!needsNewSegment) return false;
+
+    uint32_t activeSegments = journal.tail.segment - journal.head.segment + 1;
+    if (activeSegments >= JOURNAL_MAX_SEGMENTS) return true;
+
+    return LittleFS.totalBytes() - LittleFS.usedBytes() < JOURNAL_SEGMENT_SIZE;
+}
+
+bool journalAppend(const RFIDData &data)
+{
+    JournalLock lock;
+    if (!journal.mounted) return false;
+
+    // Sequence diberikan di sini agar urutannya sama dengan urutan journal
+    RFIDData record = data;
+    record.sequence = journal.nextSequence;
+
+    uint8_t frame[sizeof(JournalFrameHeader) + sizeof(RFIDData)];
+    size_t length = sizeof(RFIDData);
+    memcpy(frame + sizeof(JournalFrameHeader), &record, length);
+
+    JournalFrameHeader header;
+    header.magic = JOURNAL_RECORD_MAGIC;
+    header.length = length;
+    header.crc = journalCrc32(frame + sizeof(JournalFrameHeader), length);
+    memcpy(frame, &header, sizeof(header));
+    size_t frameSize = sizeof(header) + length;
+
+    // Rotasi ke segmen baru jika segmen aktif sudah penuh
+    if (journal.tail.offset + frameSize > JOURNAL_SEGMENT_SIZE)
+    {
+        if (journalIsFull()) return false;
+
+        if (journal.tailFile) journal.tailFile.close();
+        journal.tail.segment++;
+        journal.tail.offset = 0;
+        journalSaveCursor();
+    }
+
+    if (!journal.tailFile)
+    {
+        journal.tailFile = LittleFS.open(journalSegmentPath(journal.tail.segment), "a");
+        if (!journal.tailFile) return false;
+    }
+
+    if (journal.tailFile.write(frame, frameSize) != frameSize)
+    {
+        // Tulisan parsial: tinggalkan segmen ini, frame rusak akan dilewati
+        journal.tailFile.close();
+        journal.tail.segment++;
+        journal.tail.offset = 0;
+        journalSaveCursor();
+        return false;
+    }
+
+    // Pastikan record sudah di flash sebelum scan dianggap tersimpan
+    journal.tailFile.flush();
+    journal.tail.offset += frameSize;
+    journal.pendingCount++;
+    journal.nextSequence++;
+    return true;
+}
+
+int journalPeek(const JournalCursor &from, RFIDData *out, int maxRecords, JournalCursor &next)
+{
+    JournalLock lock;
+    next = from;
+    if (!journal.mounted) return 0;
+
+    uint8_t payload[JOURNAL_MAX_PAYLOAD];
+    File file;
+    uint32_t openSegment = 0;
+    int count = 0;
+
+    while (count < maxRecords)
+    {
+        if (next.segment == journal.tail.segment && next.offset >= journal.tail.offset) break;
+
+        if (openSegment != next.segment)
+        {
+            if (file) file.close();
+            String path = journalSegmentPath(next.segment);
+            if (LittleFS.exists(path))
+            {
+                file = LittleFS.open(path, "r");
+                if (file) file.seek(next.offset);
+            }
+            openSegment = next.segment;
+        }
+
+        uint16_t length;
+        if (file && journalReadFrame(file, payload, length))
+        {
+            next.offset += sizeof(JournalFrameHeader) + length;
+
+            // Setiap frame valid dihitung agar cocok dengan pendingCount;
+            // record yang gagal di-decode dibiarkan kosong (uidLength 0)
+            if (out != nullptr && !journalDecode(payload, length, out[count]))
+            {
+                memset(&out[count], 0, sizeof(RFIDData));
+            }
+            count++;
+            continue;
+        }
+
+        // Akhir segmen (atau frame rusak): lanjut ke segmen berikutnya
+        if (next.segment >= journal.tail.segment) break;
+        next.segment++;
+        next.offset = 0;
+    }
+
+    if (file) file.close();
+    return count;
+}
+
+void journalCommit(const JournalCursor &next, int count)
+{
+    JournalLock lock;
+    uint32_t oldSegment = journal.head.segment;
+
+    journal.head = next;
+    journal.pendingCount = (uint32_t)count > journal.pendingCount ? 0 : journal.pendingCount - count;
+    journalSaveCursor();
+
+    // Segmen yang seluruh isinya sudah terkirim dihapus agar bloknya bisa dipakai ulang
+    for (uint32_t segment = oldSegment; segment < journal.head.segment; segment++)
+    {
+        LittleFS.remove(journalSegmentPath(segment));
+    }
+}
+
+// =========================
+// ======= CLOCK FUNCTIONS =======
+// =========================
+
+const uint32_t CLOCK_BRIDGE_MAGIC = 0x434C4B42; // "CLKB"
+
+static void saveClockBridge()
+{
+    clockBridge.magic = CLOCK_BRIDGE_MAGIC;
+    clockBridge.crc = journalCrc32((const uint8_t *)&clockBridge, offsetof(ClockBridge, crc));
+}
+
+void initClock()
+{
+    clockState.bootId = esp_random() | 1;
+
+    bool bridgeValid = clockBridge.magic == CLOCK_BRIDGE_MAGIC &&
+                       journalCrc32((const uint8_t *)&clockBridge, offsetof(ClockBridge, crc)) == clockBridge.crc;
+    if (!bridgeValid)
+    {
+        memset(&clockBridge, 0, sizeof(clockBridge));
+        saveClockBridge();
+    }
+
+    // Setelah power-on / brownout timer RTC ikut reset; waktu sistem baru
+    // bisa dipercaya lagi setelah SNTP
+    esp_reset_reason_t reason = esp_reset_reason();
+    bool softReset = reason != ESP_RST_POWERON && reason != ESP_RST_BROWNOUT && reason != ESP_RST_UNKNOWN;
+
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    if (softReset && clockBridge.lastSyncUtc != 0 && now.tv_sec >= (time_t)clockBridge.lastSyncUtc &&
+        now.tv_sec - clockBridge.lastSyncUtc < CLOCK_BRIDGE_MAX_AGE)
+    {
+        int64_t offset = (int64_t)now.tv_sec * 1000 + now.tv_usec / 1000 - (int64_t)millis();
+        portENTER_CRITICAL(&clockMux);
+        clockState.offsetMs = offset;
+        clockState.valid = true;
+        clockState.bridged = true;
+        portEXIT_CRITICAL(&clockMux);
+        Serial.printf("Clock bridged from RTC: %lu UTC, last sync %lu s ago\n",
+                      (unsigned long)now.tv_sec, (unsigned long)(now.tv_sec - clockBridge.lastSyncUtc));
+    }
+
+    // Mode smooth: koreksi kecil saat resync di-slew, bukan lompatan
+    sntp_set_sync_mode(SNTP_SYNC_MODE_SMOOTH);
+    sntp_set_time_sync_notification_cb(onTimeSync);
+    configTime(0, 0, NTP_SERVER_1, NTP_SERVER_2);
+}
+
+// Dipanggil dari task lwIP setiap SNTP berhasil
+void onTimeSync(struct timeval *tv)
+{
+    int64_t offset = (int64_t)tv->tv_sec * 1000 + tv->tv_usec / 1000 - (int64_t)millis();
+
+    portENTER_CRITICAL(&clockMux);
+    int64_t drift = clockState.valid ? offset - clockState.offsetMs : 0;
+    clockState.offsetMs = offset;
+    clockState.valid = true;
+    clockState.bridged = false;
+    clockState.syncs++;
+    clockState.lastSyncMillis = millis();
+    portEXIT_CRITICAL(&clockMux);
+
+    clockBridge.lastSyncUtc = tv->tv_sec;
+    clockBridge.syncs++;
+    saveClockBridge();
+
+    Serial.printf("SNTP sync: %lu UTC, drift %ld ms\n", (unsigned long)tv->tv_sec, (long)drift);
+}
+
+uint32_t clockNowUtc()
+{
+    portENTER_CRITICAL(&clockMux);
+    bool valid = clockState.valid;
+    int64_t offset = clockState.offsetMs;
+    portEXIT_CRITICAL(&clockMux);
+
+    return valid ? (uint32_t)((offset + millis()) / 1000) : 0;
+}
+
+void stampCaptureTime(RFIDData &data)
+{
+    data.timestamp = millis();
+    data.bootId = clockState.bootId;
+    data.captureTime = clockNowUtc();
+}
+
+ClockSnapshot clockSnapshot()
+{
+    ClockSnapshot clock;
+    portENTER_CRITICAL(&clockMux);
+    clock.valid = clockState.valid;
+    clock.offsetMs = clockState.offsetMs;
+    clock.bootId = clockState.bootId;
+    portEXIT_CRITICAL(&clockMux);
+    return clock;
+}
+
+uint32_t resolveCaptureTime(const RFIDData &data, const ClockSnapshot &clock)
+{
+    if (data.captureTime != 0)
+    {
+        return data.captureTime;
+    }
+
+    // millis() dari boot lain tidak punya pemetaan; server memakai waktu terima
+    if (data.bootId == 0 || data.bootId != clock.bootId)
+    {
+        return 0;
+    }
+
+    return clock.valid ? (uint32_t)((clock.offsetMs + data.timestamp) / 1000) : 0;
+}
+
+// =========================
+// ======= UID CACHE FUNCTIONS =======
+// =========================
+
+const uint32_t UID_CACHE_MAGIC = 0x55494443; // "UIDC"
+
+static uint32_t uidCacheEntryCrc(const UIDCacheEntry &entry)
+{
+    return journalCrc32((const uint8_t *)&entry, offsetof(UIDCacheEntry, crc));
+}
+
+// Linear probing: return slot berisi UID tersebut, atau slot kosong pertama.
+// Return -1 jika tabel penuh dan UID tidak ditemukan.
+static int uidCacheFindSlot(const byte *uid, byte uidLength)
+{
+    uint32_t mask = UID_CACHE_CAPACITY - 1;
+    uint32_t index = hashUID(uid, uidLength) & mask;
+
+    for (uint32_t probe = 0; probe < UID_CACHE_CAPACITY; probe++)
+    {
+        UIDCacheEntry &entry = uidCache.entries[index];
+        if (entry.uidLength == 0)
+        {
+            return index;
+        }
+        if (entry.uidLength == uidLength && memcmp(entry.uid, uid, uidLength) == 0)
+        {
+            return index;
         }
+        index = (index + 1) & mask;
     }
-
-    digitalWrite(LED_YELLOW, LOW);
-    isProcessing = false;
-
-    // Always properly close the current card operation
-    mfrc522.PICC_HaltA();
-    mfrc522.PCD_StopCrypto1();
+    return -1;
 }
 
-// Fungsi untuk membersihkan string dari karakter null dan whitespace
-String cleanString(const String &str) {
-    String result;
-    
-    // Iterate through each character
-    for (size_t i = 0; i < str.length(); i++) {
-        // Skip null characters and non-printable characters
-        if (str[i] != '\0' && str[i] >= 32 && str[i] <= 126) {
-            result += str[i];
-        }
+bool initUIDCache()
+{
+    uidCacheMutex = xSemaphoreCreateMutex();
+    memset(uidCache.entries, 0, sizeof(uidCache.entries));
+    memset(uidCache.dirty, 0, sizeof(uidCache.dirty));
+    uidCache.count = 0;
+
+    if (!LittleFS.exists(UID_CACHE_FILE))
+    {
+        Serial.println("UID cache empty");
+        return true;
     }
-    
-    // Trim leading whitespace
-    while (result.length() > 0 && isSpace(result.charAt(0))) {
-        result = result.substring(1);
+
+    File file = LittleFS.open(UID_CACHE_FILE, "r");
+    if (!file) return false;
+
+    uint32_t header[2];
+    if (file.read((uint8_t *)header, sizeof(header)) != sizeof(header) ||
+        header[0] != UID_CACHE_MAGIC || header[1] != UID_CACHE_CAPACITY)
+    {
+        // Format lama atau kapasitas berbeda: mulai dari cache kosong
+        file.close();
+        LittleFS.remove(UID_CACHE_FILE);
+        Serial.println("UID cache reset (format mismatch)");
+        return true;
     }
-    
-    // Trim trailing whitespace
-    while (result.length() > 0 && isSpace(result.charAt(result.length() - 1))) {
-        result = result.substring(0, result.length() - 1);
+
+    for (uint32_t i = 0; i < UID_CACHE_CAPACITY; i++)
+    {
+        UIDCacheEntry entry;
+        if (file.read((uint8_t *)&entry, sizeof(entry)) != sizeof(entry)) break;
+
+        // Slot yang rusak (tulisan terpotong) diperlakukan sebagai kosong
+        if (entry.uidLength == 0 || entry.uidLength > sizeof(entry.uid) || uidCacheEntryCrc(entry) != entry.crc) continue;
+
+        uidCache.entries[i] = entry;
+        uidCache.count++;
     }
-    
-    return result;
+    file.close();
+
+    Serial.println("UID cache loaded: " + String(uidCache.count) + " cards");
+    return true;
 }
 
-// Fungsi untuk mendapatkan data untuk pengiriman batch
-String prepareDataForBatch() {
-    if (rfidBuffer.count == 0) return "";
+bool uidCacheLookup(const byte *uid, byte uidLength, RFIDData &record, bool &revalidate)
+{
+    revalidate = false;
+    if (uidCacheMutex == nullptr || uidLength == 0 || uidLength > 10) return false;
 
-    String batchData = "[";
-    int batchSize = min(MIN_BATCH_SIZE, rfidBuffer.count);
+    bool found = false;
+    xSemaphoreTake(uidCacheMutex, portMAX_DELAY);
+    int slot = uidCacheFindSlot(uid, uidLength);
+    if (slot >= 0 && uidCache.entries[slot].uidLength != 0)
+    {
+        UIDCacheEntry &entry = uidCache.entries[slot];
+        memcpy(record.blockData, entry.blockData, sizeof(record.blockData));
 
-    for (int i = 0; i < batchSize; i++) {
-        RFIDData &data = rfidBuffer.data[rfidBuffer.head];
-        
-        // Data array untuk satu baris: [NISN, NIP, Nama]
-        batchData += "[";
-        
-        // Clean and add each field
-        String cleanNISN = cleanString(data.blockData[0]);
-        String cleanNIP = cleanString(data.blockData[1]);
-        String cleanNama = cleanString(data.blockData[2]);
-        
-        // Add cleaned data with proper JSON escaping
-        batchData += "\"" + cleanNISN + "\",";
-        batchData += "\"" + cleanNIP + "\",";
-        batchData += "\"" + cleanNama + "\"";
-        
-        batchData += "]";
-        
-        if (i < batchSize - 1) batchData += ",";
-        
-        rfidBuffer.head = (rfidBuffer.head + 1) % MAX_BUFFER_SIZE;
-        rfidBuffer.count--;
+        // Setiap UID_CACHE_REVALIDATE_EVERY tap, isi kartu dibaca ulang
+        if (entry.tapsSinceVerify < 255) entry.tapsSinceVerify++;
+        revalidate = entry.tapsSinceVerify >= UID_CACHE_REVALIDATE_EVERY;
+
+        uidCache.hits++;
+        found = true;
     }
-    
-    batchData += "]";
+    else
+    {
+        uidCache.misses++;
+    }
+    xSemaphoreGive(uidCacheMutex);
 
-    Serial.println("Prepared batch data: " + batchData);
-    return batchData;
+    return found;
 }
 
+bool uidCacheStore(const byte *uid, byte uidLength, const RFIDData &record)
+{
+    if (uidCacheMutex == nullptr || uidLength == 0 || uidLength > 10) return false;
 
+    bool changed = false;
+    xSemaphoreTake(uidCacheMutex, portMAX_DELAY);
+    int slot = uidCacheFindSlot(uid, uidLength);
+    if (slot >= 0)
+    {
+        UIDCacheEntry &entry = uidCache.entries[slot];
+        bool isNew = entry.uidLength == 0;
 
-// Function to be called in main loop
-// Update handleRFID untuk memberikan feedback yang lebih baik
-void handleRFID()
-{
-    // Immediate return if WiFi is disconnected
-    if (WiFi.status() != WL_CONNECTED) {
-        if (!isProcessing) {  // Only disable once
-            mfrc522.PCD_AntennaOff();
-            isProcessing = true;
-            updateOLEDStatus("WiFi Terputus", "RFID Dinonaktifkan");
-            digitalWrite(LED_RED, HIGH);
-            errorBeep();
+        // Batasi load factor agar probing tetap pendek; kartu baru di atas
+        // batas ini tetap dibaca lengkap tanpa masuk cache
+        if (!isNew || uidCache.count < UID_CACHE_MAX_ENTRIES)
+        {
+            changed = isNew || memcmp(entry.blockData, record.blockData, sizeof(entry.blockData)) != 0;
+            if (!isNew && changed) uidCache.mismatches++;
+            if (isNew) uidCache.count++;
+
+            entry.uidLength = uidLength;
+            memcpy(entry.uid, uid, uidLength);
+            memcpy(entry.blockData, record.blockData, sizeof(entry.blockData));
+            entry.tapsSinceVerify = 0;
+            entry.crc = uidCacheEntryCrc(entry);
+            uidCache.dirty[slot / 32] |= (1u << (slot % 32));
         }
-        return;
     }
+    xSemaphoreGive(uidCacheMutex);
 
+    return changed;
+}
+
+// Dipanggil dari loop(): tulis slot yang berubah ke flash. Setiap slot
+// disalin di bawah mutex lalu ditulis di luar mutex, sehingga task RFID
+// tidak pernah menunggu operasi flash.
+void flushUIDCache()
+{
+    static unsigned long lastFlush = 0;
+    if (uidCacheMutex == nullptr || millis() - lastFlush < UID_CACHE_FLUSH_INTERVAL) return;
+    lastFlush = millis();
+
+    bool anyDirty = false;
+    for (uint32_t i = 0; i < UID_CACHE_CAPACITY / 32; i++)
+    {
+        if (uidCache.dirty[i] != 0) anyDirty = true;
+    }
+    if (!anyDirty) return;
 
-    // Add additional check for connection check in progress
-    if (!isProcessing && !isSending && isGScriptConnected)
+    if (!LittleFS.exists(UID_CACHE_FILE))
     {
-        if (WiFi.status() != WL_CONNECTED)
+        // Buat file dengan ukuran penuh agar setiap slot punya offset tetap
+        File file = LittleFS.open(UID_CACHE_FILE, "w");
+        if (!file) return;
+        uint32_t header[2] = {UID_CACHE_MAGIC, UID_CACHE_CAPACITY};
+        file.write((const uint8_t *)header, sizeof(header));
+        UIDCacheEntry empty;
+        memset(&empty, 0, sizeof(empty));
+        for (uint32_t i = 0; i < UID_CACHE_CAPACITY; i++)
         {
-            updateOLEDStatus("WiFi Disconnected", "RFID Disabled");
-            blinkLED(LED_YELLOW, 2, 300);
-            return;
+            file.write((const uint8_t *)&empty, sizeof(empty));
         }
+        file.close();
+    }
 
-        if (rfidBuffer.count >= MIN_BATCH_SIZE) {
-            updateOLEDStatus("Buffer Full", "Please wait...");
-            return;
+    File file = LittleFS.open(UID_CACHE_FILE, "r+");
+    if (!file) return;
+
+    uint32_t written = 0;
+    for (uint32_t slot = 0; slot < UID_CACHE_CAPACITY; slot++)
+    {
+        UIDCacheEntry entry;
+        bool isDirty = false;
+
+        xSemaphoreTake(uidCacheMutex, portMAX_DELAY);
+        if (uidCache.dirty[slot / 32] & (1u << (slot % 32)))
+        {
+            entry = uidCache.entries[slot];
+            uidCache.dirty[slot / 32] &= ~(1u << (slot % 32));
+            isDirty = true;
         }
-        
-        processRFIDCard();
-    }
-    else if (!isGScriptConnected) {
-        updateOLEDStatus("GScript Error", "RFID Disabled");
-        blinkLED(LED_RED, 1, 300);
+        xSemaphoreGive(uidCacheMutex);
+
+        if (!isDirty) continue;
+
+        file.seek(2 * sizeof(uint32_t) + slot * sizeof(UIDCacheEntry));
+        file.write((const uint8_t *)&entry, sizeof(entry));
+        written++;
     }
+    file.close();
+
+    Serial.printf("UID cache flushed %lu slots (%lu cards, %lu hits, %lu misses, %lu changed)\n",
+                  (unsigned long)written, (unsigned long)uidCache.count,
+                  (unsigned long)uidCache.hits, (unsigned long)uidCache.misses,
+                  (unsigned long)uidCache.mismatches);
 }
 
 // =========================
@@ -1481,11 +4472,13 @@ void handleRFID()
 
 void initOLED()
 {
+    DisplayLock lock;
     if (!display.begin(SSD1306_SWITCHCAPVCC, SCREEN_ADDRESS))
     {
         Serial.println(F("Gagal menginisialisasi OLED"));
         return;
     }
+    oledRenderer.shadowValid = false; // Isi GDDRAM setelah init tidak diketahui
     display.clearDisplay();
     display.setTextSize(1);
     display.setTextColor(SSD1306_WHITE);
@@ -1496,41 +4489,193 @@ void initOLED()
     display.println(F("Inisialisasi..."));
     display.println(F("Sistem Absensi"));
     display.println(F("SDS Telkom Batam"));
-    display.display();
+    flushOLED();
     delay(2000);
 }
 
 void clearOLED()
 {
-    display.clearDisplay();
-    display.display();
+    DisplayMessage message = {};
+    message.kind = DISPLAY_CLEAR;
+    postDisplay(message);
 }
 
-void updateOLEDStatus(const String &primaryText, const String &secondaryText, bool showDefaultDisplay)
+static void postDisplayText(DisplayKind kind, const char *primaryText, const char *secondaryText)
 {
-    display.clearDisplay();
-    display.setTextSize(1);
-    display.setCursor(0, 0);
+    DisplayMessage message;
+    message.kind = kind;
+    message.step = 0;
+    message.steps = 0;
+    strlcpy(message.primary, primaryText, sizeof(message.primary));
+    strlcpy(message.secondary, secondaryText, sizeof(message.secondary));
+    postDisplay(message);
+}
+
+void postOLEDStatus(const char *primaryText, const char *secondaryText)
+{
+    postDisplayText(DISPLAY_STATUS, primaryText, secondaryText);
+}
 
+void updateOLEDStatus(const String &primaryText, const String &secondaryText, bool showDefaultDisplay)
+{
     if (showDefaultDisplay && WiFi.status() == WL_CONNECTED)
     {
         showDefaultOLEDDisplay();
+        return;
     }
-    else
+    postOLEDStatus(primaryText.c_str(), secondaryText.c_str());
+}
+
+// Hasil scan masih dalam masa tampil (scanFeedbackUntil)
+bool scanFeedbackShowing()
+{
+    unsigned long until = scanFeedbackUntil;
+    return until != 0 && (long)(millis() - until) < 0;
+}
+
+// Mailbox display hanya satu slot: layar idle yang dikirim selama hasil scan
+// masih ditampilkan akan menimpa "Berhasil Scan"/"Read Failed" sebelum
+// sempat digambar.
+void showDefaultOLEDDisplay()
+{
+    if (scanFeedbackShowing())
+    {
+        return;
+    }
+    postDisplayText(DISPLAY_IDLE, "", "");
+}
+
+static void countOLEDBytes(uint32_t bytes)
+{
+    oledRenderer.bytesSent += bytes;
+    oledRenderer.windowBytes += bytes;
+}
+
+// Satu transaksi I2C berisi beberapa perintah (control byte 0x00)
+static bool sendOLEDCommands(const uint8_t *commands, size_t count)
+{
+    Wire.beginTransmission(SCREEN_ADDRESS);
+    Wire.write((uint8_t)0x00);
+    Wire.write(commands, count);
+    countOLEDBytes(count + 2);
+    return Wire.endTransmission() == 0;
+}
+
+// Tulis kolom col0..col1 pada satu page. Mode alamat horizontal (diset
+// display.begin()) membuat jendela page/kolom ini terisi berurutan.
+static bool sendOLEDSpan(uint8_t page, uint8_t col0, uint8_t col1, const uint8_t *data)
+{
+    const uint8_t window[] = {SSD1306_PAGEADDR, page, page, SSD1306_COLUMNADDR, col0, col1};
+    if (!sendOLEDCommands(window, sizeof(window))) return false;
+
+    size_t remaining = col1 - col0 + 1;
+    while (remaining > 0)
+    {
+        size_t chunk = min(remaining, (size_t)(OLED_I2C_CHUNK - 1));
+        Wire.beginTransmission(SCREEN_ADDRESS);
+        Wire.write((uint8_t)0x40);
+        Wire.write(data, chunk);
+        countOLEDBytes(chunk + 2);
+        if (Wire.endTransmission() != 0) return false;
+        data += chunk;
+        remaining -= chunk;
+    }
+    return true;
+}
+
+void flushOLED()
+{
+    DisplayLock lock;
+    const uint8_t *frame = display.getBuffer();
+    if (!frame) return;
+    oledRenderer.frames++;
+
+    bool sent = false;
+    for (uint8_t page = 0; page < OLED_PAGES; page++)
     {
-        display.println(primaryText);
-        if (secondaryText.length() > 0)
+        const uint8_t *row = frame + page * SCREEN_WIDTH;
+        uint8_t *shadowRow = oledRenderer.shadow + page * SCREEN_WIDTH;
+        int first = 0;
+        int last = SCREEN_WIDTH - 1;
+        if (oledRenderer.shadowValid)
         {
-            display.println(secondaryText);
+            while (first < SCREEN_WIDTH && row[first] == shadowRow[first]) first++;
+            if (first == SCREEN_WIDTH) continue; // Page tidak berubah
+            while (row[last] == shadowRow[last]) last--;
         }
 
-        // Jika ada data di buffer, tampilkan total di bagian bawah
-        if (rfidBuffer.count > 0)
+        if (!sent)
+        {
+            Wire.setClock(OLED_I2C_CLOCK);
+            sent = true;
+        }
+        if (!sendOLEDSpan(page, first, last, row + first))
         {
-            display.println(); // Beri jarak
-            display.print("Total Scanned: ");
-            display.println(rfidBuffer.count);
+            // Isi panel tidak pasti lagi, kirim frame penuh pada flush berikutnya
+            oledRenderer.i2cErrors++;
+            oledRenderer.shadowValid = false;
+            return;
         }
+        memcpy(shadowRow + first, row + first, last - first + 1);
+        oledRenderer.pagesSent++;
+    }
+    oledRenderer.shadowValid = true;
+    if (!sent) oledRenderer.skippedFrames++;
+
+    uint32_t elapsed = millis() - oledRenderer.windowStart;
+    if (elapsed >= OLED_RATE_WINDOW)
+    {
+        oledRenderer.bytesPerSecond = (uint64_t)oledRenderer.windowBytes * 1000 / elapsed;
+        oledRenderer.windowBytes = 0;
+        oledRenderer.windowStart = millis();
+    }
+}
+
+void showErrorOLED(const String &errorMsg)
+{
+    postDisplayText(DISPLAY_ERROR, errorMsg.c_str(), "");
+}
+
+void showAPInfoOLED()
+{
+    postDisplayText(DISPLAY_AP_INFO, "", "");
+}
+
+void showConnectedOLED(const String &ssid, const String &ip)
+{
+    postDisplayText(DISPLAY_CONNECTED, ssid.c_str(), ip.c_str());
+}
+
+void postDisplay(const DisplayMessage &message)
+{
+    if (!displayQueue.mailbox)
+    {
+        // Task display belum berjalan (awal setup): render langsung
+        renderDisplayMessage(message);
+        return;
+    }
+    if (uxQueueMessagesWaiting(displayQueue.mailbox) > 0)
+    {
+        displayQueue.merged++;
+    }
+    displayQueue.posted++;
+    xQueueOverwrite(displayQueue.mailbox, &message);
+}
+
+static void drawStatusScreen(const DisplayMessage &message)
+{
+    display.println(message.primary);
+    if (message.secondary[0] != '\0')
+    {
+        display.println(message.secondary);
+    }
+
+    // Jika ada data di buffer, tampilkan total di bagian bawah
+    if (pendingScanCount() > 0)
+    {
+        display.println(); // Beri jarak
+        display.print("Total Scanned: ");
+        display.println(pendingScanCount());
     }
 
     if (isSending)
@@ -1538,47 +4683,163 @@ void updateOLEDStatus(const String &primaryText, const String &secondaryText, bo
         display.setCursor(0, SCREEN_HEIGHT - 8);
         display.println("Mengirim data...");
     }
-
-    display.display();
 }
 
-void showDefaultOLEDDisplay()
+static void drawIdleScreen()
 {
-    display.clearDisplay();
-    display.setTextSize(1);
-    display.setCursor(0, 0);
-
     // Header
     display.println("SDS Telkom Batam");
     display.println("----------------");
 
     // Network Info
-    display.print("SSID: ");
-    display.println(WiFi.SSID());
-    display.print("IP: ");
-    display.println(WiFi.localIP().toString());
+    bool online = WiFi.status() == WL_CONNECTED;
+    if (online)
+    {
+        display.print("SSID: ");
+        display.println(WiFi.SSID());
+        display.print("IP: ");
+        display.println(WiFi.localIP());
+    }
+    else
+    {
+        display.println("OFFLINE");
+        display.println("Scan tetap disimpan");
+    }
 
     // Blank line for spacing
     display.println();
 
-    // Only show total scanned if buffer has data
-    if (rfidBuffer.count > 0)
+    // Antrian yang belum terkirim, plus perkiraan waktu kirim saat backlog
+    uint32_t pending = pendingScanCount();
+    if (pending > 0)
     {
-        display.print("Total Scanned: ");
-        display.println(rfidBuffer.count);
+        display.print("Antrian: ");
+        display.println(pending);
+        if (online && backlogDraining())
+        {
+            uint32_t eta = backlogDrainEtaSeconds();
+            display.printf("Selesai ~%lu:%02lu\n", (unsigned long)(eta / 60), (unsigned long)(eta % 60));
+        }
     }
+}
+
+static void drawAPInfoScreen()
+{
+    display.println("Mode AP Aktif");
+    display.println("----------------");
+    display.print("SSID: ");
+    display.println(AP_SSID);
+    display.print("Pass: ");
+    display.println(AP_PASSWORD);
+    display.print("IP: ");
+    display.println(apIP);
+}
+
+static void drawConnectingScreen(const DisplayMessage &message)
+{
+    display.println("Menghubungkan ke:");
+    display.println(message.primary);
+    display.println();
+
+    // Gambar progress bar
+    int progressWidth = (message.step * (SCREEN_WIDTH - 4)) / max((uint8_t)1, message.steps);
+    display.drawRect(0, 32, SCREEN_WIDTH, 8, SSD1306_WHITE);
+    display.fillRect(2, 34, progressWidth, 4, SSD1306_WHITE);
+
+    // Tampilkan nomor percobaan
+    char attemptText[24];
+    snprintf(attemptText, sizeof(attemptText), "Percobaan %u/%u", message.step, message.steps);
+    int16_t x1, y1;
+    uint16_t w, h;
+    display.getTextBounds(attemptText, 0, 0, &x1, &y1, &w, &h);
+    display.setCursor((SCREEN_WIDTH - w) / 2, 45);
+    display.println(attemptText);
+}
 
-    display.display();
+static void drawConnectedScreen(const DisplayMessage &message)
+{
+    display.println("Terhubung!");
+    display.println("----------------");
+    display.print("SSID: ");
+    display.println(message.primary);
+    display.print("IP: ");
+    display.println(message.secondary);
 }
 
-void showErrorOLED(const String &errorMsg)
+void renderDisplayMessage(const DisplayMessage &message)
 {
+    DisplayLock lock;
     display.clearDisplay();
     display.setTextSize(1);
     display.setCursor(0, 0);
-    display.println("ERROR:");
-    display.println(errorMsg);
-    display.display();
+
+    switch (message.kind)
+    {
+    case DISPLAY_STATUS:
+        drawStatusScreen(message);
+        break;
+    case DISPLAY_IDLE:
+        drawIdleScreen();
+        break;
+    case DISPLAY_ERROR:
+        display.println("ERROR:");
+        display.println(message.primary);
+        break;
+    case DISPLAY_AP_INFO:
+        drawAPInfoScreen();
+        break;
+    case DISPLAY_CONNECTING:
+        drawConnectingScreen(message);
+        break;
+    case DISPLAY_CONNECTED:
+        drawConnectedScreen(message);
+        break;
+    case DISPLAY_CLEAR:
+        break;
+    }
+
+    flushOLED();
+}
+
+void initDisplayTask()
+{
+    displayQueue.mailbox = xQueueCreate(1, sizeof(DisplayMessage));
+    if (!displayQueue.mailbox)
+    {
+        Serial.println("Display queue gagal dibuat, render langsung");
+        return;
+    }
+    xTaskCreatePinnedToCore(displayTask, "display", DISPLAY_TASK_STACK, nullptr,
+                            DISPLAY_TASK_PRIORITY, &displayQueue.task, DISPLAY_TASK_CORE);
+}
+
+// Satu-satunya yang menggambar ke OLED setelah setup(). Setelah satu frame,
+// task tidur sampai DISPLAY_FRAME_INTERVAL habis; pesan yang masuk selama itu
+// saling menimpa sehingga hanya keadaan terakhir yang dirender.
+void displayTask(void *parameter)
+{
+    DisplayMessage message;
+
+    for (;;)
+    {
+        if (xQueueReceive(displayQueue.mailbox, &message, portMAX_DELAY) != pdTRUE)
+        {
+            continue;
+        }
+
+        unsigned long start = millis();
+        renderDisplayMessage(message);
+        uint32_t elapsed = millis() - start;
+
+        displayQueue.rendered++;
+        displayQueue.lastRenderMs = elapsed;
+        displayQueue.maxRenderMs = max(displayQueue.maxRenderMs, elapsed);
+
+        if (elapsed < DISPLAY_FRAME_INTERVAL)
+        {
+            vTaskDelay(pdMS_TO_TICKS(DISPLAY_FRAME_INTERVAL - elapsed));
+        }
+    }
 }
 
 // =========================
@@ -1598,73 +4859,214 @@ void updateLEDStatus(ErrorType error)
     switch (error)
     {
     case NO_ERROR:
-        digitalWrite(LED_GREEN, WiFi.status() == WL_CONNECTED);
-        digitalWrite(LED_RED, LOW);
-        digitalWrite(LED_YELLOW, isSending);
+        // Merah selama WiFi terputus atau GScript belum menjawab
+        setLEDLevel(LED_GREEN, WiFi.status() == WL_CONNECTED);
+        setLEDLevel(LED_RED, !isAPMode && (WiFi.status() != WL_CONNECTED || !isGScriptConnected));
+        setLEDLevel(LED_YELLOW, isSending);
         break;
     case WIFI_CONNECTION_FAILED:
     case GOOGLE_SCRIPT_CONNECTION_FAILED:
-        digitalWrite(LED_GREEN, LOW);
-        digitalWrite(LED_RED, HIGH);
-        digitalWrite(LED_YELLOW, LOW);
+        setLEDLevel(LED_GREEN, LOW);
+        setLEDLevel(LED_RED, HIGH);
+        setLEDLevel(LED_YELLOW, LOW);
         break;
     default:
-        digitalWrite(LED_GREEN, LOW);
-        digitalWrite(LED_RED, HIGH);
-        digitalWrite(LED_YELLOW, isSending);
+        setLEDLevel(LED_GREEN, LOW);
+        setLEDLevel(LED_RED, HIGH);
+        setLEDLevel(LED_YELLOW, isSending);
+    }
+}
+
+void blinkLED(uint8_t pin, uint8_t times, uint16_t delayMs)
+{
+    for (uint8_t output = 0; output < FEEDBACK_BUZZER; output++)
+    {
+        if (FEEDBACK_PINS[output] == pin)
+        {
+            FeedbackCue cue = {(FeedbackOutput)output, times, (uint16_t)(delayMs / 2), (uint16_t)(delayMs / 2)};
+            startFeedbackCue(cue, FEEDBACK_PRIORITY_NORMAL, false, FEEDBACK_ADHOC);
+            return;
+        }
+    }
+}
+
+void setAllLEDs(bool state)
+{
+    setLEDLevel(LED_GREEN, state);
+    setLEDLevel(LED_RED, state);
+    setLEDLevel(LED_YELLOW, state);
+}
+
+// =========================
+// ======= IMPLEMENTASI BUZZER =======
+// =========================
+
+void initBuzzer()
+{
+    pinMode(BUZZER_PIN, OUTPUT);
+    digitalWrite(BUZZER_PIN, LOW);
+}
+
+void beep(uint8_t times, uint16_t durationMs)
+{
+    FeedbackCue cue = {FEEDBACK_BUZZER, times, durationMs, durationMs};
+    startFeedbackCue(cue, FEEDBACK_PRIORITY_NORMAL, false, FEEDBACK_ADHOC);
+}
+
+void errorBeep()
+{
+    // 3 beep pendek untuk error
+    FeedbackCue cue = {FEEDBACK_BUZZER, 3, 100, 100};
+    startFeedbackCue(cue, FEEDBACK_PRIORITY_HIGH, false, FEEDBACK_ADHOC);
+}
+
+void successBeep()
+{
+    beep(1, 200); // 1 beep panjang untuk sukses
+}
+
+// =========================
+// ======= IMPLEMENTASI FEEDBACK =======
+// =========================
+
+void initFeedback()
+{
+    esp_timer_create_args_t args = {};
+    args.callback = feedbackTick;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = "feedback";
+    args.skip_unhandled_events = true;
+    if (esp_timer_create(&args, &feedback.timer) != ESP_OK ||
+        esp_timer_start_periodic(feedback.timer, FEEDBACK_TICK_MS * 1000ULL) != ESP_OK)
+    {
+        Serial.println("Feedback timer gagal dibuat");
     }
 }
 
-void blinkLED(uint8_t pin, uint8_t times, uint16_t delayMs)
+// Pasang cue pada voice output-nya. Hanya mengubah state di bawah spinlock,
+// pin diubah oleh feedbackTick() paling lambat FEEDBACK_TICK_MS kemudian.
+void startFeedbackCue(const FeedbackCue &cue, FeedbackPriority priority, bool loop, FeedbackKind kind)
 {
-    for (uint8_t i = 0; i < times; i++)
+    if (cue.times == 0 || cue.output >= FEEDBACK_OUTPUT_COUNT) return;
+
+    portENTER_CRITICAL(&feedbackMux);
+    FeedbackVoice &voice = feedback.voices[cue.output];
+    if (voice.remaining > 0)
     {
-        digitalWrite(pin, HIGH);
-        delay(delayMs / 2);
-        digitalWrite(pin, LOW);
-        delay(delayMs / 2);
+        if (voice.cue.onMs == cue.onMs && voice.cue.offMs == cue.offMs && voice.loop == loop)
+        {
+            // Cue sama masih berjalan: cukup perpanjang, jangan diulang dari awal
+            voice.remaining = max(voice.remaining, cue.times);
+            voice.priority = max(voice.priority, priority);
+            feedback.merged++;
+            portEXIT_CRITICAL(&feedbackMux);
+            return;
+        }
+        if (priority < voice.priority)
+        {
+            feedback.dropped++;
+            portEXIT_CRITICAL(&feedbackMux);
+            return;
+        }
+        feedback.preempted++;
     }
+
+    voice.cue = cue;
+    voice.remaining = cue.times;
+    voice.loop = loop;
+    voice.on = false;
+    voice.priority = priority;
+    voice.kind = kind;
+    voice.phaseEnd = millis();
+    feedback.started++;
+    portEXIT_CRITICAL(&feedbackMux);
 }
 
-void setAllLEDs(bool state)
+void playFeedback(FeedbackKind kind)
 {
-    digitalWrite(LED_GREEN, state);
-    digitalWrite(LED_RED, state);
-    digitalWrite(LED_YELLOW, state);
+    if (kind >= FEEDBACK_KIND_COUNT) return;
+    const FeedbackPattern &pattern = FEEDBACK_PATTERNS[kind];
+    for (uint8_t i = 0; i < pattern.cueCount; i++)
+    {
+        startFeedbackCue(pattern.cues[i], pattern.priority, pattern.loop, kind);
+    }
 }
 
-// =========================
-// ======= IMPLEMENTASI BUZZER =======
-// =========================
-
-void initBuzzer()
+void stopFeedback(FeedbackKind kind)
 {
-    pinMode(BUZZER_PIN, OUTPUT);
-    digitalWrite(BUZZER_PIN, LOW);
+    portENTER_CRITICAL(&feedbackMux);
+    for (uint8_t output = 0; output < FEEDBACK_OUTPUT_COUNT; output++)
+    {
+        FeedbackVoice &voice = feedback.voices[output];
+        if (voice.remaining > 0 && voice.kind == kind)
+        {
+            // Level dasar dipulihkan feedbackTick() berikutnya
+            voice.remaining = 0;
+            voice.on = false;
+            voice.phaseEnd = millis();
+        }
+    }
+    portEXIT_CRITICAL(&feedbackMux);
 }
 
-void beep(uint8_t times, uint16_t durationMs)
+void setLEDLevel(uint8_t pin, bool level)
 {
-    for (uint8_t i = 0; i < times; i++)
+    for (uint8_t output = 0; output < FEEDBACK_BUZZER; output++)
     {
-        digitalWrite(BUZZER_PIN, HIGH);
-        delay(durationMs);
-        digitalWrite(BUZZER_PIN, LOW);
-        if (i < times - 1)
+        if (FEEDBACK_PINS[output] == pin)
         {
-            delay(durationMs);
+            portENTER_CRITICAL(&feedbackMux);
+            feedback.base[output] = level;
+            portEXIT_CRITICAL(&feedbackMux);
+            return;
         }
     }
 }
 
-void errorBeep()
+static void setFeedbackPin(uint8_t output, bool level)
 {
-    beep(3, 100); // 3 beep pendek untuk error
+    FeedbackVoice &voice = feedback.voices[output];
+    if (voice.level != level)
+    {
+        digitalWrite(FEEDBACK_PINS[output], level);
+        voice.level = level;
+    }
 }
 
-void successBeep()
+// Berjalan di task esp_timer: hanya menyentuh pin pada pergantian fase,
+// atau saat level dasar voice yang idle berubah
+void feedbackTick(void *arg)
 {
-    beep(1, 200); // 1 beep panjang untuk sukses
+    unsigned long now = millis();
+
+    portENTER_CRITICAL(&feedbackMux);
+    for (uint8_t output = 0; output < FEEDBACK_OUTPUT_COUNT; output++)
+    {
+        FeedbackVoice &voice = feedback.voices[output];
+        if ((long)(now - voice.phaseEnd) < 0) continue;
+
+        if (voice.remaining == 0)
+        {
+            // Jeda mati terakhir sudah lewat: kembali ke indikator status
+            setFeedbackPin(output, feedback.base[output]);
+            voice.phaseEnd = now;
+            continue;
+        }
+
+        if (!voice.on)
+        {
+            setFeedbackPin(output, HIGH);
+            voice.on = true;
+            voice.phaseEnd = now + voice.cue.onMs;
+            continue;
+        }
+
+        setFeedbackPin(output, LOW);
+        voice.on = false;
+        if (!voice.loop) voice.remaining--;
+        voice.phaseEnd = now + voice.cue.offMs;
+    }
+    portEXIT_CRITICAL(&feedbackMux);
 }
 
 // =========================
@@ -1757,11 +5159,12 @@ bool connectToWiFi(const String &ssid, const String &password) {
     
     updateOLEDStatus("Menghubungkan", "ke " + ssid);
 
+    playFeedback(FEEDBACK_PROGRESS);
     while (WiFi.status() != WL_CONNECTED && 
            millis() - startAttemptTime < WIFI_TIMEOUT) {
         delay(100);
-        blinkLED(LED_YELLOW, 1, 100);
     }
+    stopFeedback(FEEDBACK_PROGRESS);
 
     if (WiFi.status() == WL_CONNECTED) {
         // Update tampilan OLED dengan informasi koneksi
@@ -1778,19 +5181,10 @@ bool connectToWiFi(const String &ssid, const String &password) {
 
 void checkAndUpdateWiFiStatus() {
     if (isAPMode) {
-        display.clearDisplay();
-        display.setTextSize(1);
-        display.setCursor(0, 0);
-        display.println("Mode AP Aktif");
-        display.println("----------------");
-        display.println("SSID: " + String(AP_SSID));
-        display.println("Pass: " + String(AP_PASSWORD));
-        display.println("IP: " + apIP.toString());
-        display.display();
-    } else if (WiFi.status() == WL_CONNECTED) {
-        showDefaultOLEDDisplay();
+        showAPInfoOLED();
     } else {
-        updateOLEDStatus("Tidak Terhubung", "Mencoba koneksi ulang...");
+        // Online maupun offline: tampilan default menampilkan status & antrian
+        showDefaultOLEDDisplay();
     }
 }
 
@@ -1803,30 +5197,36 @@ void switchToAPMode() {
     setupAP();
     
     // Update tampilan OLED untuk mode AP dengan informasi lengkap
-    display.clearDisplay();
-    display.setTextSize(1);
-    display.setCursor(0, 0);
-    display.println("Mode AP Aktif");
-    display.println("----------------");
-    display.println("SSID: " + String(AP_SSID));
-    display.println("Pass: " + String(AP_PASSWORD));
-    display.println("IP: " + apIP.toString());
-    display.display();
+    showAPInfoOLED();
 
     successBeep();
 }
 
 // Setup Web Server
 void setupWebServer() {
-    // Basic routes
-    server.on("/", HTTP_GET, handleRoot);
-    server.on("/scan", HTTP_GET, handleWiFiScan);
+    // Dipanggil dari beberapa jalur koneksi; route & listener cukup sekali
+    static bool started = false;
+    if (started) return;
+    started = true;
+
+    // Halaman & stylesheet statis dari web/; /ota terpisah karena butuh login
+    for (size_t i = 0; i < WEB_ASSET_COUNT; i++) {
+        const WebAsset &asset = WEB_ASSETS[i];
+        if (strcmp(asset.path, "/ota") == 0) continue;
+        server.on(asset.path, HTTP_GET, [&asset](AsyncWebServerRequest *request) {
+            serveWebAsset(request, asset);
+        });
+    }
+
+    // Endpoint dinamis (JSON / aksi)
+    server.on("/networks", HTTP_GET, handleWiFiNetworks);
     server.on("/connect", HTTP_POST, handleConnect);
     server.on("/status", HTTP_GET, handleStatus);
     server.on("/forget", HTTP_POST, handleForget);
     
     // OTA routes
     server.on("/ota", HTTP_GET, handleOTAUpdate);
+    server.on("/firmware", HTTP_GET, handleFirmwareInfo);
     server.on("/check-update", HTTP_GET, handleCheckUpdate);
     server.on("/start-update", HTTP_POST, handleStartUpdate);
     
@@ -1838,369 +5238,150 @@ void setupWebServer() {
 
 // Fungsi baru untuk menangani kegagalan koneksi
 void handleConnectionFailure() {
-    // Visual feedback
-    updateOLEDStatus("Koneksi Gagal", "Beralih ke Mode AP...");
+    // Kredensial hanya tersimpan setelah pernah berhasil (handleConnect), jadi
+    // gagal saat boot biasanya berarti router belum siap. Mulai offline:
+    // scan tetap disimpan dan checkWiFiConnection() terus mencoba.
+    updateOLEDStatus("Koneksi Gagal", "Mode offline");
     blinkLED(LED_RED, 5, 300);
     errorBeep();
-    delay(1000);
-
-    // Hapus kredensial
-    resetWiFiCredentials();
-
-    // Update OLED sebelum restart
-    updateOLEDStatus("Memulai Ulang", "Mode AP akan aktif");
-    delay(2000);
-
-    // Feedback akhir
-    blinkLED(LED_YELLOW, 3, 500);
-    beep(2, 300);
 
-    ESP.restart();
+    wifiOfflineSince = millis() | 1;
+    lastWiFiCheck = millis();
 }
 
 // Fungsi untuk menampilkan progress koneksi
 void showConnectionProgress(int attempt, int maxAttempts)
 {
-    display.clearDisplay();
-    display.setTextSize(1);
-    display.setCursor(0, 0);
-    display.println("Menghubungkan ke:");
-    display.println(wifiCred.ssid);
-    display.println();
-
-    // Gambar progress bar
-    int progressWidth = (attempt * (SCREEN_WIDTH - 4)) / maxAttempts;
-    display.drawRect(0, 32, SCREEN_WIDTH, 8, SSD1306_WHITE);
-    display.fillRect(2, 34, progressWidth, 4, SSD1306_WHITE);
-
-    // Tampilkan nomor percobaan
-    String attemptText = "Percobaan " + String(attempt) + "/" + String(maxAttempts);
-    int16_t x1, y1;
-    uint16_t w, h;
-    display.getTextBounds(attemptText, 0, 0, &x1, &y1, &w, &h);
-    display.setCursor((SCREEN_WIDTH - w) / 2, 45);
-    display.println(attemptText);
-
-    display.display();
+    DisplayMessage message;
+    message.kind = DISPLAY_CONNECTING;
+    message.step = constrain(attempt, 0, 255);
+    message.steps = constrain(maxAttempts, 1, 255);
+    strlcpy(message.primary, wifiCred.ssid.c_str(), sizeof(message.primary));
+    message.secondary[0] = '\0';
+    postDisplay(message);
 }
 
 // Handler Web Server
-void handleRoot() {
-    String html = R"(
-    <!DOCTYPE html>
-    <html>
-    <head>
-        <meta name='viewport' content='width=device-width, initial-scale=1.0'>
-        <title>SDS Telkom Batam WiFi Manager</title>
-        <style>
-            body { font-family: Arial; margin: 0; padding: 20px; background: #f0f0f0; }
-            .container { max-width: 500px; margin: 0 auto; background: white; padding: 20px; border-radius: 8px; box-shadow: 0 2px 4px rgba(0,0,0,0.1); }
-            .btn { background: #007bff; color: white; padding: 10px 20px; border: none; border-radius: 4px; cursor: pointer; margin: 5px; }
-            .btn:hover { background: #0056b3; }
-            .btn-danger { background: #dc3545; }
-            .btn-danger:hover { background: #c82333; }
-            .btn-warning { background: #ffc107; color: #000; }
-            .btn-warning:hover { background: #e0a800; }
-            .status { margin: 20px 0; padding: 15px; border-radius: 4px; }
-            .connected { background: #d4edda; color: #155724; }
-            .disconnected { background: #f8d7da; color: #721c24; }
-            .info { background: #cce5ff; color: #004085; padding: 10px; border-radius: 4px; margin: 10px 0; }
-            .header { text-align: center; margin-bottom: 20px; }
-            .loading { display: none; text-align: center; padding: 20px; }
-            .spinner { border: 4px solid #f3f3f3; border-top: 4px solid #3498db; border-radius: 50%; width: 40px; height: 40px; animation: spin 1s linear infinite; margin: 10px auto; }
-            @keyframes spin { 0% { transform: rotate(0deg); } 100% { transform: rotate(360deg); } }
-            .current-network { background: #e8f5e9; padding: 15px; border-radius: 4px; margin: 10px 0; }
-            .update-available { background: #fff3cd; color: #856404; padding: 10px; border-radius: 4px; margin: 10px 0; display: none; }
-        </style>
-    </head>
-    <body>
-        <div class='container'>
-            <div class='header'>
-                <h1>WiFi Manager</h1>
-                <h2>SDS Telkom Batam</h2>
-            </div>
-            
-            <div id='currentNetwork' class='current-network'></div>
-            
-            <div class='info'>
-                Anda dapat mengubah jaringan WiFi, menghapus koneksi saat ini, atau memperbarui firmware.
-            </div>
-
-            <div id='updateNotification' class='update-available'>
-                <strong>Pembaruan Tersedia!</strong> 
-                <span id='updateVersion'></span>
-            </div>
-            
-            <div id='status' class='status'></div>
-            
-            <div class='loading' id='loadingSection'>
-                <div class='spinner'></div>
-                <p>Sedang memproses...</p>
-            </div>
-            
-            <div style='text-align: center;'>
-                <button class='btn' onclick='scanWiFi()'>Hubungkan ke WiFi Lain</button>
-                <button class='btn btn-danger' onclick='forgetCurrentNetwork()'>Lupakan Jaringan Ini</button>
-                <button class='btn btn-warning' onclick='checkFirmwareUpdate()'>Cek Pembaruan</button>
-                <button class='btn' onclick='location.href="/ota"'>Kelola Firmware</button>
-            </div>
-        </div>
-        <script>
-            function showLoading() {
-                document.getElementById('loadingSection').style.display = 'block';
-            }
-            
-            function hideLoading() {
-                document.getElementById('loadingSection').style.display = 'none';
-            }
-            
-            function scanWiFi() {
-                if(confirm('Anda akan mencari jaringan WiFi baru. Lanjutkan?')) {
-                    showLoading();
-                    location.href = '/scan';
-                }
-            }
-            
-            function forgetCurrentNetwork() {
-                if(confirm('Anda yakin ingin melupakan jaringan ini? Perangkat akan mencoba masuk ke mode AP.')) {
-                    showLoading();
-                    fetch('/forget', { method: 'POST' })
-                        .then(response => response.text())
-                        .then(data => {
-                            alert(data);
-                            location.reload();
-                        });
-                }
-            }
+const WebAsset *findWebAsset(const char *path)
+{
+    for (size_t i = 0; i < WEB_ASSET_COUNT; i++)
+    {
+        if (strcmp(WEB_ASSETS[i].path, path) == 0) return &WEB_ASSETS[i];
+    }
+    return nullptr;
+}
 
-            function checkFirmwareUpdate() {
-                showLoading();
-                fetch('/check-update')
-                    .then(response => response.json())
-                    .then(data => {
-                        hideLoading();
-                        const updateNotification = document.getElementById('updateNotification');
-                        const updateVersion = document.getElementById('updateVersion');
-                        
-                        if (data.updateAvailable) {
-                            updateVersion.textContent = '(Versi ' + data.version + ' tersedia)';
-                            updateNotification.style.display = 'block';
-                        } else {
-                            alert('Tidak ada pembaruan tersedia. Sistem Anda sudah versi terbaru.');
-                        }
-                    })
-                    .catch(error => {
-                        hideLoading();
-                        alert('Error memeriksa pembaruan: ' + error.message);
-                    });
-            }
-            
-            function updateStatus() {
-                fetch('/status')
-                    .then(response => response.json())
-                    .then(data => {
-                        const statusDiv = document.getElementById('status');
-                        const currentNetworkDiv = document.getElementById('currentNetwork');
-                        
-                        statusDiv.className = 'status ' + (data.connected ? 'connected' : 'disconnected');
-                        let statusHtml = `<strong>Status:</strong> ${data.status}<br>`;
-                        statusHtml += `<strong>IP:</strong> ${data.ip}`;
-                        statusDiv.innerHTML = statusHtml;
-                        
-                        if(data.connected) {
-                            currentNetworkDiv.innerHTML = `
-                                <h3>Jaringan Saat Ini:</h3>
-                                <strong>SSID:</strong> ${data.ssid}<br>
-                                <strong>Kekuatan Sinyal:</strong> ${data.rssi} dBm<br>
-                                <strong>IP Address:</strong> ${data.ip}
-                            `;
-                        } else {
-                            currentNetworkDiv.innerHTML = '<p>Tidak terhubung ke jaringan WiFi</p>';
-                        }
-                        
-                        hideLoading();
-                    });
-            }
-            
-            // Check for updates when page loads
-            window.addEventListener('load', function() {
-                updateStatus();
-                checkFirmwareUpdate();
-            });
-            
-            // Update status every 5 seconds
-            setInterval(updateStatus, 5000);
-        </script>
-    </body>
-    </html>
-    )";
-    server.send(200, "text/html", html);
+// Isi asset sudah gzip di flash dan dikirim langsung dari sana tanpa salinan
+// di heap. ETag dari hash isi, jadi browser yang sudah punya versi yang sama
+// cukup menerima 304.
+void serveWebAsset(AsyncWebServerRequest *request, const WebAsset &asset)
+{
+    AsyncWebServerResponse *response;
+    const AsyncWebHeader *ifNoneMatch = request->getHeader("If-None-Match");
+    if (ifNoneMatch && ifNoneMatch->value().indexOf(asset.etag) >= 0)
+    {
+        response = request->beginResponse(304);
+        webAssetStats.notModified++;
+    }
+    else
+    {
+        response = request->beginResponse_P(200, asset.contentType, asset.data, asset.length);
+        response->addHeader("Content-Encoding", "gzip");
+        webAssetStats.served++;
+        webAssetStats.bytes += asset.length;
+    }
+    response->addHeader("ETag", asset.etag);
+    response->addHeader("Cache-Control", asset.versioned ? WEB_CACHE_VERSIONED : WEB_CACHE_PAGE);
+    request->send(response);
+}
+
+// SSID bisa berisi kutip & UTF-8: escape kutip/backslash, buang kontrol
+void appendJsonString(String &json, const String &value)
+{
+    json += '"';
+    for (size_t i = 0; i < value.length(); i++)
+    {
+        char c = value[i];
+        if ((uint8_t)c < 32) continue;
+        if (c == '"' || c == '\\') json += '\\';
+        json += c;
+    }
+    json += '"';
 }
 
 // Tambahkan handler untuk melupakan jaringan
-void handleForget()
+void handleForget(AsyncWebServerRequest *request)
 {
     if (WiFi.status() == WL_CONNECTED)
     {
-        // Simpan kredensial sebelumnya
-        previousSSID = wifiCred.ssid;
-        previousPassword = wifiCred.password;
-
-        // Reset kredensial
-        resetWiFiCredentials();
-
-        server.send(200, "text/plain", "Berhasil melupakan jaringan");
-
-        // Tunggu sebentar sebelum restart
-        delay(1000);
-        ESP.restart();
+        // Reset kredensial & restart dijalankan loop() setelah respons terkirim
+        portalActions.fetch_or(PORTAL_FORGET);
+        request->send(200, "text/plain", "Berhasil melupakan jaringan");
     }
     else
     {
-        server.send(400, "text/plain", "Tidak ada jaringan yang terhubung");
-    }
-}
-
-void handleWiFiScan()
-{
-    int n = WiFi.scanNetworks();
-    String html = R"(
-    <!DOCTYPE html>
-    <html>
-    <head>
-        <meta name='viewport' content='width=device-width, initial-scale=1.0'>
-        <title>Jaringan WiFi Tersedia</title>
-        <style>
-            body { font-family: Arial; margin: 0; padding: 20px; background: #f0f0f0; }
-            .container { max-width: 500px; margin: 0 auto; background: white; padding: 20px; border-radius: 8px; box-shadow: 0 2px 4px rgba(0,0,0,0.1); }
-            .network { margin: 10px 0; padding: 15px; border: 1px solid #ddd; border-radius: 4px; cursor: pointer; display: flex; justify-content: space-between; align-items: center; }
-            .network:hover { background: #f8f9fa; }
-            .network.current { background: #e8f5e9; border-color: #4caf50; }
-            .btn { background: #007bff; color: white; padding: 10px 20px; border: none; border-radius: 4px; cursor: pointer; }
-            .btn:hover { background: #0056b3; }
-            .signal-strength { padding: 5px 10px; border-radius: 3px; color: white; font-size: 0.9em; }
-            .signal-excellent { background: #4caf50; }
-            .signal-good { background: #8bc34a; }
-            .signal-fair { background: #ffc107; }
-            .signal-poor { background: #ff5722; }
-            .loading { display: none; text-align: center; padding: 20px; }
-            .spinner { border: 4px solid #f3f3f3; border-top: 4px solid #3498db; border-radius: 50%; width: 40px; height: 40px; animation: spin 1s linear infinite; margin: 10px auto; }
-            @keyframes spin { 0% { transform: rotate(0deg); } 100% { transform: rotate(360deg); } }
-            #password-input { display: none; margin-top: 20px; padding: 20px; background: #f8f9fa; border-radius: 4px; }
-            #password-input input[type="password"] { width: 100%; padding: 10px; margin: 10px 0; border: 1px solid #ddd; border-radius: 4px; }
-        </style>
-    </head>
-    <body>
-        <div class='container'>
-            <h1>Jaringan WiFi Tersedia</h1>
-            <p>Pilih jaringan untuk menghubungkan:</p>
-            <div id='networks'>)";
-
-    // Tambahkan jaringan yang terdeteksi
-    for (int i = 0; i < n; ++i)
-    {
-        String currentClass = (WiFi.SSID(i) == WiFi.SSID()) ? "network current" : "network";
-        String signalStrength;
-        String signalClass;
-
-        // Kategorikan kekuatan sinyal
-        int rssi = WiFi.RSSI(i);
-        if (rssi >= -50)
-        {
-            signalStrength = "Excellent";
-            signalClass = "signal-excellent";
-        }
-        else if (rssi >= -60)
-        {
-            signalStrength = "Good";
-            signalClass = "signal-good";
-        }
-        else if (rssi >= -70)
-        {
-            signalStrength = "Fair";
-            signalClass = "signal-fair";
-        }
-        else
-        {
-            signalStrength = "Poor";
-            signalClass = "signal-poor";
-        }
+        request->send(400, "text/plain", "Tidak ada jaringan yang terhubung");
+    }
+}
 
-        html += "<div class='" + currentClass + "' onclick='selectNetwork(\"" + WiFi.SSID(i) + "\")'>";
-        html += "<div class='network-info'>";
-        html += "<strong>" + WiFi.SSID(i) + "</strong>";
-        if (WiFi.SSID(i) == WiFi.SSID())
-        {
-            html += " (Current)";
-        }
-        html += "</div>";
-        html += "<span class='signal-strength " + signalClass + "'>" + signalStrength + " (" + String(WiFi.RSSI(i)) + " dBm)</span>";
-        html += "</div>";
-    }
-
-    html += R"(
-            </div>
-            <form action='/connect' method='POST' id='wifi-form'>
-                <input type='hidden' name='ssid' id='ssid-input'>
-                <div id='password-input'>
-                    <h3 id='selected-network'></h3>
-                    <input type='password' name='password' placeholder='Password WiFi' required>
-                    <div style='text-align: right; margin-top: 10px;'>
-                        <button type='button' class='btn' onclick='cancelSelection()'>Batal</button>
-                        <button type='submit' class='btn'>Hubungkan</button>
-                    </div>
-                </div>
-            </form>
-            <div class='loading' id='loadingSection'>
-                <div class='spinner'></div>
-                <p>Memindai jaringan...</p>
-            </div>
-            <div style='margin-top: 20px;'>
-                <button onclick='location.href="/"' class='btn'>Kembali ke Menu Utama</button>
-                <button onclick='refreshNetworks()' class='btn'>Pindai Ulang</button>
-            </div>
-        </div>
-        <script>
-            function selectNetwork(ssid) {
-                document.getElementById('ssid-input').value = ssid;
-                document.getElementById('selected-network').textContent = 'Jaringan: ' + ssid;
-                document.getElementById('password-input').style.display = 'block';
-                // Scroll to password input
-                document.getElementById('password-input').scrollIntoView({ behavior: 'smooth' });
-            }
-            
-            function cancelSelection() {
-                document.getElementById('password-input').style.display = 'none';
-                document.getElementById('ssid-input').value = '';
-            }
-            
-            function refreshNetworks() {
-                document.getElementById('loadingSection').style.display = 'block';
-                location.reload();
-            }
-            
-            document.getElementById('wifi-form').onsubmit = function() {
-                document.getElementById('loadingSection').style.display = 'block';
-                document.getElementById('loadingSection').querySelector('p').textContent = 'Menghubungkan...';
-            }
-        </script>
-    </body>
-    </html>
-    )";
+void handleWiFiNetworks(AsyncWebServerRequest *request)
+{
+    // Scan sinkron menahan task async_tcp beberapa detik: scan dijalankan
+    // async dan halaman /scan mengulang request sampai hasilnya tersedia
+    int n = WiFi.scanComplete();
+    if (n != WIFI_SCAN_RUNNING && (n == WIFI_SCAN_FAILED || request->hasArg("rescan")))
+    {
+        WiFi.scanDelete();
+        WiFi.scanNetworks(true);
+        n = WIFI_SCAN_RUNNING;
+    }
+    if (n < 0)
+    {
+        request->send(200, "application/json", "{\"scanning\":true}");
+        return;
+    }
 
-    server.send(200, "text/html", html);
+    String json = "{\"current\":";
+    appendJsonString(json, WiFi.SSID());
+    json += ",\"networks\":[";
+    for (int i = 0; i < n; ++i)
+    {
+        if (i > 0) json += ",";
+        json += "{\"ssid\":";
+        appendJsonString(json, WiFi.SSID(i));
+        json += ",\"rssi\":" + String(WiFi.RSSI(i)) + "}";
+    }
+    json += "]}";
+    request->send(200, "application/json", json);
 }
 
-void handleConnect()
+void handleConnect(AsyncWebServerRequest *request)
 {
-    if (!server.hasArg("ssid") || !server.hasArg("password"))
+    if (!request->hasArg("ssid") || !request->hasArg("password"))
+    {
+        request->send(400, "text/plain", "SSID dan password diperlukan");
+        return;
+    }
+    if (portalConnect.state == PORTAL_CONNECT_PENDING)
     {
-        server.send(400, "text/plain", "SSID dan password diperlukan");
+        request->send(409, "text/plain", "Masih mencoba koneksi sebelumnya");
         return;
     }
 
-    String newSSID = server.arg("ssid");
-    String newPassword = server.arg("password");
+    // Percobaan koneksi (hingga WIFI_TIMEOUT) berjalan di loop(); halaman
+    // /connecting membaca hasilnya dari /status
+    portalConnect.ssid = request->arg("ssid");
+    portalConnect.password = request->arg("password");
+    portalConnect.state = PORTAL_CONNECT_PENDING;
+    portalActions.fetch_or(PORTAL_CONNECT);
+
+    request->redirect("/connecting");
+}
+
+void applyPortalConnect()
+{
+    String newSSID = portalConnect.ssid;
+    String newPassword = portalConnect.password;
 
     // Simpan kredensial lama sebelum mencoba yang baru
     previousSSID = wifiCred.ssid;
@@ -2231,49 +5412,15 @@ void handleConnect()
         isAPMode = false; // Penting: ubah mode
 
         // Update tampilan OLED dengan informasi baru
-        display.clearDisplay();
-        display.setTextSize(1);
-        display.setCursor(0, 0);
-        display.println("Terhubung!");
-        display.println("----------------");
-        display.println("SSID: " + newSSID);
-        display.println("IP: " + WiFi.localIP().toString());
-        display.display();
+        showConnectedOLED(newSSID, WiFi.localIP().toString());
 
         // Feedback sukses
         successBeep();
         blinkLED(LED_GREEN, 3, 200);
 
-        String html = R"(
-    <!DOCTYPE html>
-    <html>
-    <head>
-        <meta name='viewport' content='width=device-width, initial-scale=1.0'>
-        <meta http-equiv='refresh' content='5;url=/'>
-        <title>Berhasil Terhubung</title>
-        <style>
-            body { font-family: Arial; margin: 0; padding: 20px; background: #f0f0f0; }
-            .container { max-width: 500px; margin: 0 auto; background: white; padding: 20px; border-radius: 8px; box-shadow: 0 2px 4px rgba(0,0,0,0.1); }
-            .success { color: #155724; background: #d4edda; padding: 15px; border-radius: 4px; }
-        </style>
-    </head>
-    <body>
-        <div class='container'>
-            <div class='success'>
-                <h2>Berhasil Terhubung!</h2>
-                <p>Terhubung ke: )" +
-                      newSSID + R"(</p>
-                <p>IP: )" +
-                      WiFi.localIP().toString() + R"(</p>
-                <p>Silahkan akses kembali menggunakan IP address baru</p>
-            </div>
-            <p>Halaman akan dialihkan dalam 5 detik...</p>
-        </div>
-    </body>
-    </html>
-    )";
-
-        server.send(200, "text/html", html);
+        portalConnect.resultSsid = newSSID;
+        portalConnect.resultIp = WiFi.localIP().toString();
+        portalConnect.state = PORTAL_CONNECT_CONNECTED;
 
         // Tampilkan pesan di OLED
         updateOLEDStatus("Koneksi Berhasil", "Restarting...");
@@ -2282,7 +5429,7 @@ void handleConnect()
         successBeep();
         blinkLED(LED_GREEN, 3, 200);
         
-        // Tunggu sebentar agar response HTTP terkirim
+        // Tunggu sebentar agar halaman sempat membaca hasil lewat /status
         delay(2000);
         
         // Restart ESP32
@@ -2312,65 +5459,16 @@ void handleConnect()
             if (connected)
             {
                 // Berhasil kembali ke jaringan sebelumnya
-                String html = R"(
-                <!DOCTYPE html>
-                <html>
-                <head>
-                    <meta name='viewport' content='width=device-width, initial-scale=1.0'>
-                    <meta http-equiv='refresh' content='5;url=/'>
-                    <title>Gagal Terhubung</title>
-                    <style>
-                        body { font-family: Arial; margin: 0; padding: 20px; background: #f0f0f0; }
-                        .container { max-width: 500px; margin: 0 auto; background: white; padding: 20px; border-radius: 8px; }
-                        .warning { color: #856404; background: #fff3cd; padding: 15px; border-radius: 4px; }
-                    </style>
-                </head>
-                <body>
-                    <div class='container'>
-                        <div class='warning'>
-                            <h2>Gagal Terhubung ke Jaringan Baru</h2>
-                            <p>Kembali ke jaringan sebelumnya: )" +
-                              previousSSID + R"(</p>
-                        </div>
-                        <p>Halaman akan dialihkan dalam 5 detik...</p>
-                    </div>
-                </body>
-                </html>
-                )";
-
-                server.send(200, "text/html", html);
+                portalConnect.resultSsid = previousSSID;
+                portalConnect.resultIp = WiFi.localIP().toString();
+                portalConnect.state = PORTAL_CONNECT_REVERTED;
             }
             else
             {
                 // Gagal total, masuk mode AP
                 resetWiFiCredentials();
-                String html = R"(
-                <!DOCTYPE html>
-                <html>
-                <head>
-                    <meta name='viewport' content='width=device-width, initial-scale=1.0'>
-                    <meta http-equiv='refresh' content='5;url=/'>
-                    <title>Gagal Terhubung</title>
-                    <style>
-                        body { font-family: Arial; margin: 0; padding: 20px; background: #f0f0f0; }
-                        .container { max-width: 500px; margin: 0 auto; background: white; padding: 20px; border-radius: 8px; }
-                        .error { color: #721c24; background: #f8d7da; padding: 15px; border-radius: 4px; }
-                    </style>
-                </head>
-                <body>
-                    <div class='container'>
-                        <div class='error'>
-                            <h2>Gagal Terhubung</h2>
-                            <p>Tidak dapat terhubung ke jaringan baru maupun sebelumnya.</p>
-                            <p>Beralih ke mode AP...</p>
-                        </div>
-                    </div>
-                </body>
-                </html>
-                )";
-
-                server.send(200, "text/html", html);
-                delay(1000);
+                portalConnect.state = PORTAL_CONNECT_FAILED;
+                delay(2000);
                 ESP.restart();
             }
         }
@@ -2378,39 +5476,14 @@ void handleConnect()
         {
             // Tidak ada jaringan sebelumnya, langsung ke mode AP
             resetWiFiCredentials();
-            String html = R"(
-            <!DOCTYPE html>
-            <html>
-            <head>
-                <meta name='viewport' content='width=device-width, initial-scale=1.0'>
-                <meta http-equiv='refresh' content='5;url=/'>
-                <title>Gagal Terhubung</title>
-                <style>
-                    body { font-family: Arial; margin: 0; padding: 20px; background: #f0f0f0; }
-                    .container { max-width: 500px; margin: 0 auto; background: white; padding: 20px; border-radius: 8px; }
-                    .error { color: #721c24; background: #f8d7da; padding: 15px; border-radius: 4px; }
-                </style>
-            </head>
-            <body>
-                <div class='container'>
-                    <div class='error'>
-                        <h2>Gagal Terhubung</h2>
-                        <p>Tidak dapat terhubung ke jaringan baru.</p>
-                        <p>Beralih ke mode AP...</p>
-                    </div>
-                </div>
-            </body>
-            </html>
-            )";
-
-            server.send(200, "text/html", html);
-            delay(1000);
+            portalConnect.state = PORTAL_CONNECT_FAILED;
+            delay(2000);
             ESP.restart();
         }
     }
 }
 
-void handleStatus()
+void handleStatus(AsyncWebServerRequest *request)
 {
     String status = "Tidak Terhubung";
     String ssid = "";
@@ -2439,17 +5512,172 @@ void handleStatus()
     json += ",\"ssid\":\"" + ssid + "\"";
     json += ",\"ip\":\"" + ip + "\"";
     json += ",\"rssi\":\"" + rssi + "\"";
+    json += ",\"scanHits\":" + String(recentUIDs.hits);
+    json += ",\"duplicateDrops\":" + String(recentUIDs.drops);
+    json += ",\"freeHeap\":" + String(ESP.getFreeHeap());
+    json += ",\"minFreeHeap\":" + String(ESP.getMinFreeHeap());
+    json += ",\"maxAllocHeap\":" + String(ESP.getMaxAllocHeap());
+    json += ",\"batchFormat\":\"" + String(BATCH_FORMAT_NAMES[gscriptBatchFormat]) + "\"";
+    json += ",\"batchEncoding\":\"" + String(gscriptBatchGzip ? "gzip" : "identity") + "\"";
+    json += ",\"deviceId\":\"" + String(deviceId()) + "\"";
+    PortalConnectState connectState = portalConnect.state;
+    json += ",\"portalConnect\":{";
+    json += "\"state\":\"" + String(PORTAL_CONNECT_STATE_NAMES[connectState]) + "\"";
+    json += ",\"target\":";
+    appendJsonString(json, portalConnect.ssid);
+    if (connectState == PORTAL_CONNECT_CONNECTED || connectState == PORTAL_CONNECT_REVERTED)
+    {
+        json += ",\"ssid\":";
+        appendJsonString(json, portalConnect.resultSsid);
+        json += ",\"ip\":\"" + portalConnect.resultIp + "\"";
+    }
+    json += "}";
+    json += ",\"webAssets\":{";
+    json += "\"served\":" + String(webAssetStats.served);
+    json += ",\"notModified\":" + String(webAssetStats.notModified);
+    json += ",\"bytes\":" + String(webAssetStats.bytes) + "}";
+    json += ",\"clock\":{";
+    json += "\"valid\":" + String(clockState.valid ? "true" : "false");
+    json += ",\"bridged\":" + String(clockState.bridged ? "true" : "false");
+    json += ",\"utc\":" + String(clockNowUtc());
+    json += ",\"syncs\":" + String(clockState.syncs);
+    json += ",\"lastSyncAgoMs\":" + String(clockState.syncs ? millis() - clockState.lastSyncMillis : 0) + "}";
+    json += ",\"nextSequence\":" + String(journal.nextSequence);
+    json += ",\"upload\":{";
+    json += "\"queuedBatches\":" + String(uploader.queue ? uxQueueMessagesWaiting(uploader.queue) : 0);
+    json += ",\"sealedRecords\":" + String(uploader.sealedRecords);
+    json += ",\"batchesSent\":" + String(uploader.batchesSent);
+    json += ",\"failedAttempts\":" + String(uploader.failedAttempts);
+    json += ",\"partialAcks\":" + String(uploader.partialAcks);
+    json += ",\"deadLettered\":" + String(uploader.deadLettered);
+    json += ",\"lastDeadLetter\":" + String(uploader.lastDeadLetter);
+    json += ",\"lastUploadMs\":" + String(uploader.lastUploadMs);
+    json += ",\"rawBytes\":" + String(uploader.rawBytes);
+    json += ",\"wireBytes\":" + String(uploader.wireBytes);
+    json += ",\"ringStalls\":" + String(uploader.ringStalls);
+    json += ",\"ringStallMs\":" + String(uploader.ringStallMs);
+    json += ",\"admissionStalls\":" + String(uploader.admissionStalls);
+    json += ",\"admissionStallMs\":" + String(uploader.admissionStallMs) + "}";
+    json += ",\"offline\":{";
+    json += "\"offlineForMs\":" + String(wifiOfflineSince ? millis() - wifiOfflineSince : 0);
+    json += ",\"backlog\":" + String(pendingScanCount());
+    json += ",\"draining\":" + String(backlogDraining() ? "true" : "false");
+    json += ",\"drainEtaS\":" + String(backlogDraining() ? backlogDrainEtaSeconds() : 0) + "}";
+    json += ",\"scheduler\":{";
+    json += "\"maxDeliveryDelayMs\":" + String(MAX_DELIVERY_DELAY);
+    json += ",\"arrivalIntervalMs\":" + String((unsigned long)batchScheduler.arrivalIntervalMs);
+    json += ",\"uploadLatencyMs\":" + String((unsigned long)batchScheduler.uploadLatencyMs);
+    json += ",\"targetBatch\":" + String(batchScheduler.targetSize);
+    json += ",\"flushBudgetMs\":" + String(batchScheduler.flushBudgetMs);
+    json += ",\"lastReason\":\"" + String(FLUSH_REASON_NAMES[batchScheduler.lastReason]) + "\"";
+    json += ",\"lastBatch\":" + String(batchScheduler.lastBatchSize);
+    json += ",\"lastBatchAgeMs\":" + String(batchScheduler.lastBatchAgeMs) + "}";
+    json += ",\"gscriptHealth\":{";
+    json += "\"state\":\"" + String(gscriptHealthState()) + "\"";
+    json += ",\"lastSuccessAgoMs\":" + String(gscriptHealth.lastSuccess ? millis() - gscriptHealth.lastSuccess : 0);
+    json += ",\"lastFailureAgoMs\":" + String(gscriptHealth.lastFailure ? millis() - gscriptHealth.lastFailure : 0);
+    json += ",\"idleProbeIntervalMs\":" + String(GSCRIPT_IDLE_PROBE_INTERVAL);
+    json += ",\"idleProbes\":" + String(gscriptHealth.idleProbes);
+    json += ",\"idleProbeFailures\":" + String(gscriptHealth.idleProbeFailures) + "}";
+    json += ",\"gscriptBreaker\":{";
+    json += "\"state\":\"" + String(BREAKER_STATE_NAMES[gscriptBreaker.state]) + "\"";
+    json += ",\"consecutiveFailures\":" + String(gscriptBreaker.consecutiveFailures);
+    json += ",\"retryInMs\":" + String(gscriptRetryWaitMs());
+    json += ",\"lastBackoffMs\":" + String(gscriptBreaker.lastBackoffMs);
+    json += ",\"trips\":" + String(gscriptBreaker.trips);
+    json += ",\"probes\":" + String(gscriptBreaker.probes) + "}";
+    json += ",\"feedback\":{";
+    json += "\"started\":" + String(feedback.started);
+    json += ",\"merged\":" + String(feedback.merged);
+    json += ",\"preempted\":" + String(feedback.preempted);
+    json += ",\"dropped\":" + String(feedback.dropped) + "}";
+    json += ",\"display\":{";
+    json += "\"posted\":" + String(displayQueue.posted);
+    json += ",\"merged\":" + String(displayQueue.merged);
+    json += ",\"rendered\":" + String(displayQueue.rendered);
+    json += ",\"lastRenderMs\":" + String(displayQueue.lastRenderMs);
+    json += ",\"maxRenderMs\":" + String(displayQueue.maxRenderMs) + "}";
+    json += ",\"oled\":{";
+    json += "\"bytesPerSecond\":" + String(oledRenderer.bytesPerSecond);
+    json += ",\"bytesSent\":" + String(oledRenderer.bytesSent);
+    json += ",\"frames\":" + String(oledRenderer.frames);
+    json += ",\"skippedFrames\":" + String(oledRenderer.skippedFrames);
+    json += ",\"pagesSent\":" + String(oledRenderer.pagesSent);
+    json += ",\"i2cErrors\":" + String(oledRenderer.i2cErrors) + "}";
+    json += ",\"gscriptConnections\":{";
+    for (GScriptConnection *connection : {&scriptConnection, &redirectConnection}) {
+        if (connection != &scriptConnection) json += ",";
+        json += "\"" + String(connection->name) + "\":{";
+        json += "\"handshakes\":" + String(connection->handshakes);
+        json += ",\"handshakeFailures\":" + String(connection->handshakeFailures);
+        json += ",\"reuses\":" + String(connection->reuses);
+        json += ",\"lastHandshakeMs\":" + String(connection->lastHandshakeMs);
+        json += ",\"avgHandshakeMs\":" + String(connection->totalHandshakeMs / max((uint32_t)1, connection->handshakes)) + "}";
+    }
+    json += "}";
+    json += ",\"rfidRecovery\":{";
+    for (int tier = 0; tier < RECOVERY_TIER_COUNT; tier++) {
+        if (tier > 0) json += ",";
+        json += "\"" + String(RECOVERY_TIER_NAMES[tier]) + "\":{";
+        json += "\"attempts\":" + String(recoveryStats.attempts[tier]);
+        json += ",\"healthy\":" + String(recoveryStats.healthy[tier]);
+        json += ",\"lastDowntimeMs\":" + String(recoveryStats.lastDowntimeMs[tier]);
+        json += ",\"totalDowntimeMs\":" + String(recoveryStats.totalDowntimeMs[tier]) + "}";
+    }
+    json += "}";
+#if RFID_USE_IRQ
+    json += ",\"rfidSpuriousIrqs\":" + String(rfidSpuriousIrqs);
+#endif
     json += "}";
 
-    server.send(200, "application/json", json);
+    request->send(200, "application/json", json);
 }
 
-void handleReset()
+void handleReset(AsyncWebServerRequest *request)
 {
-    resetWiFiCredentials();
-    server.send(200, "text/plain", "WiFi reset berhasil");
-    delay(1000);
-    ESP.restart();
+    portalActions.fetch_or(PORTAL_RESET);
+    request->send(200, "text/plain", "WiFi reset berhasil");
+}
+
+// Satu-satunya tempat aksi portal yang blocking dijalankan. Server web tetap
+// melayani request selama aksi berjalan karena berada di task async_tcp.
+void handlePortalActions()
+{
+    uint8_t actions = portalActions.load();
+    if (actions == 0) return;
+
+    if (actions & PORTAL_CHECK_UPDATE)
+    {
+        checkFirmwareUpdate();
+        portalActions.fetch_and((uint8_t)~PORTAL_CHECK_UPDATE);
+    }
+
+    if (actions & PORTAL_START_UPDATE)
+    {
+        portalActions.fetch_and((uint8_t)~PORTAL_START_UPDATE);
+        updateFirmware(); // Restart sendiri bila berhasil
+    }
+
+    if (actions & PORTAL_CONNECT)
+    {
+        applyPortalConnect();
+        portalActions.fetch_and((uint8_t)~PORTAL_CONNECT);
+    }
+
+    if (actions & (PORTAL_FORGET | PORTAL_RESET))
+    {
+        if (actions & PORTAL_FORGET)
+        {
+            // Simpan kredensial sebelumnya
+            previousSSID = wifiCred.ssid;
+            previousPassword = wifiCred.password;
+        }
+        resetWiFiCredentials();
+
+        // Tunggu sebentar agar respons HTTP terkirim sebelum restart
+        delay(1000);
+        ESP.restart();
+    }
 }
 
 // Fungsi EEPROM
@@ -2467,75 +5695,74 @@ void saveWiFiCredentials(const String &ssid, const String &password)
 }
 
 void checkWiFiConnection() {
-    if (millis() - lastWiFiCheck >= WIFI_CHECK_INTERVAL) {
-        lastWiFiCheck = millis();
+    if (isAPMode) return;
 
-        if (!isAPMode && WiFi.status() != WL_CONNECTED) {
-            // Immediately disable RFID
-            mfrc522.PCD_AntennaOff();
-            isProcessing = true; // Block RFID processing
-            
-            updateOLEDStatus("Koneksi Terputus", "RFID Dinonaktifkan");
-            digitalWrite(LED_RED, HIGH);
-            digitalWrite(LED_GREEN, LOW);
-            errorBeep();
+    if (WiFi.status() == WL_CONNECTED) {
+        if (wifiOfflineSince != 0) {
+            Serial.printf("WiFi reconnected after %lu s, backlog %lu records\n",
+                          (millis() - wifiOfflineSince) / 1000, (unsigned long)journal.pendingCount);
+            wifiOfflineSince = 0;
+            stopOfflinePortal();
+            updateOLEDStatus("WiFi Terhubung", "Mengirim antrian");
+            successBeep();
+            setupWebServer();
+        }
+        return;
+    }
 
-            WiFi.disconnect();
-            WiFi.begin(wifiCred.ssid.c_str(), wifiCred.password.c_str());
+    // Offline: antena tetap menyala, scan disimpan di journal
+    if (wifiOfflineSince == 0) {
+        wifiOfflineSince = millis() | 1;
+        lastWiFiCheck = millis();
+        updateOLEDStatus("WiFi Terputus", "Scan tetap disimpan");
+        errorBeep();
+    }
 
-            unsigned long startAttemptTime = millis();
-            bool reconnected = false;
-            int attemptCount = 0;
-            const int MAX_ATTEMPTS = 3;
+    if (WIFI_OFFLINE_AP_TIMEOUT > 0 && millis() - wifiOfflineSince >= WIFI_OFFLINE_AP_TIMEOUT) {
+        // Journal tetap di flash dan dikirim setelah jaringan dikonfigurasi ulang
+        updateOLEDStatus("Gagal Terhubung", "Mode AP Aktif");
+        resetWiFiCredentials();
+        delay(2000);
+        ESP.restart();
+    }
 
-            while (attemptCount < MAX_ATTEMPTS && !reconnected) {
-                startAttemptTime = millis();
-                
-                while (millis() - startAttemptTime < WIFI_TIMEOUT) {
-                    if (WiFi.status() == WL_CONNECTED) {
-                        updateOLEDStatus("WiFi Terhubung", "RFID Aktif Kembali");
-                        digitalWrite(LED_RED, LOW);
-                        digitalWrite(LED_GREEN, HIGH);
-                        successBeep();
-                        
-                        // Re-enable RFID only after successful reconnection
-                        mfrc522.PCD_AntennaOn();
-                        isProcessing = false;
-                        
-                        reconnected = true;
-                        setupWebServer();
-                        break;
-                    }
-                    delay(500);
-                }
-                
-                if (!reconnected) {
-                    attemptCount++;
-                    if (attemptCount < MAX_ATTEMPTS) {
-                        updateOLEDStatus("Mencoba Koneksi", "Percobaan " + String(attemptCount + 1));
-                        errorBeep();
-                        delay(1000);
-                    }
-                }
-            }
+    if (WIFI_OFFLINE_PORTAL_DELAY > 0 && !offlinePortalActive && millis() - wifiOfflineSince >= WIFI_OFFLINE_PORTAL_DELAY) {
+        startOfflinePortal();
+    }
 
-            if (!reconnected) {
-                updateOLEDStatus("Gagal Terhubung", "Mode AP Aktif");
-                resetWiFiCredentials();
-                digitalWrite(LED_RED, LOW);
-                digitalWrite(LED_GREEN, HIGH);
-                
-                // Ensure RFID remains disabled
-                mfrc522.PCD_AntennaOff();
-                isProcessing = true;
-                
-                delay(2000);
-                ESP.restart();
-            }
-        }
+    // Reconnect tanpa menunggu: hasilnya terlihat di panggilan berikutnya
+    if (millis() - lastWiFiCheck >= WIFI_CHECK_INTERVAL) {
+        lastWiFiCheck = millis();
+        Serial.println("WiFi offline, reconnecting...");
+        WiFi.disconnect();
+        WiFi.begin(wifiCred.ssid.c_str(), wifiCred.password.c_str());
     }
 }
 
+void startOfflinePortal()
+{
+    WiFi.mode(WIFI_AP_STA);
+    WiFi.softAPConfig(apIP, apIP, IPAddress(255, 255, 255, 0));
+    WiFi.softAP(AP_SSID, AP_PASSWORD);
+    dnsServer.start(DNS_PORT, "*", apIP);
+    setupWebServer();
+
+    offlinePortalActive = true;
+    Serial.printf("WiFi offline for %lu s, portal %s started\n",
+                  (millis() - wifiOfflineSince) / 1000, AP_SSID);
+    updateOLEDStatus("WiFi Terputus", String("Portal: ") + AP_SSID);
+}
+
+void stopOfflinePortal()
+{
+    if (!offlinePortalActive) return;
+
+    dnsServer.stop();
+    WiFi.softAPdisconnect(true);
+    WiFi.mode(WIFI_STA);
+    offlinePortalActive = false;
+}
+
 void resetWiFiCredentials()
 {
     writeEEPROM(EEPROM_SSID_ADDR, "");
@@ -2578,29 +5805,20 @@ void handleWiFiLoop() {
         // Update tampilan OLED untuk mode AP
         if (millis() - lastDisplayUpdate >= DISPLAY_UPDATE_INTERVAL) {
             lastDisplayUpdate = millis();
-            display.clearDisplay();
-            display.setTextSize(1);
-            display.setCursor(0, 0);
-            display.println("Mode AP Aktif");
-            display.println("----------------");
-            display.println("SSID: " + String(AP_SSID));
-            display.println("Pass: " + String(AP_PASSWORD));
-            display.println("IP: " + apIP.toString());
-            display.display();
+            showAPInfoOLED();
         }
     } else {
-        // Cek dan update status koneksi WiFi
-        if (WiFi.status() == WL_CONNECTED) {
-            if (millis() - lastDisplayUpdate >= DISPLAY_UPDATE_INTERVAL) {
-                lastDisplayUpdate = millis();
-                showDefaultOLEDDisplay();
-            }
-        } else {
-            checkWiFiConnection();
+        // Cek dan update status koneksi WiFi; layar juga diperbarui saat
+        // offline untuk menampilkan antrian
+        checkWiFiConnection();
+        if (offlinePortalActive) {
+            dnsServer.processNextRequest();
+        }
+        if (millis() - lastDisplayUpdate >= DISPLAY_UPDATE_INTERVAL) {
+            lastDisplayUpdate = millis();
+            showDefaultOLEDDisplay();
         }
     }
-
-    server.handleClient();
 }
 
 // =========================
@@ -2610,57 +5828,81 @@ void handleWiFiLoop() {
 void setup()
 {
     Serial.begin(115200);
+    loopTaskHandle = xTaskGetCurrentTaskHandle();
+    displayMutex = xSemaphoreCreateRecursiveMutex();
+    journalMutex = xSemaphoreCreateRecursiveMutex();
     Wire.begin(33, 32);
 
     initLEDs();
     initBuzzer();
+    initFeedback();
     initOLED();
+    initDisplayTask();
 
     setAllLEDs(true);
     delay(500);
     setAllLEDs(false);
     successBeep();
 
+    // Pulihkan journal sebelum RFID aktif
+    if (!initJournal()) {
+        showErrorOLED("Journal gagal");
+        delay(2000);
+    }
+    initUIDCache();
+
+#ifdef BATCH_FORMAT_BENCHMARK
+    benchmarkBatchFormats();
+#endif
+
     // Inisialisasi WiFi
     initWiFi();
 
+    // Jam UTC untuk waktu scan (butuh stack TCP/IP dari WiFi)
+    initClock();
+
     // Init RFID
     initRFID();
 
     // init Google Script
     setupGoogleApps();
+
+    // Upload batch di background
+    initUploader();
 }
 
 void loop() {
+    handlePortalActions();
+
     if (!isOTAInProgress) {
-        // Check WiFi status first
-        if (WiFi.status() != WL_CONNECTED && !isAPMode) {
-            // Immediately disable RFID if WiFi disconnected
-            if (!isProcessing) {
-                mfrc522.PCD_AntennaOff();
-                isProcessing = true;
-                updateOLEDStatus("WiFi Terputus", "RFID Dinonaktifkan");
-                digitalWrite(LED_RED, HIGH);
-                errorBeep();
-            }
+        // Pindahkan hasil scan dari task RFID ke journal
+        drainScanQueue();
+
+        if (rfidRestartRequested) {
+            handleCriticalRFIDFailure();
         }
+        flushUIDCache();
+        reportHeapUsage();
 
         handleWiFiLoop();
         updateLEDStatus(currentError);
 
+        // Jangan timpa nama hasil scan yang masih ditampilkan
         unsigned long currentMillis = millis();
-        if (currentMillis - lastOLEDUpdate >= OLED_UPDATE_INTERVAL) {
+        if (!scanFeedbackShowing() && currentMillis - lastOLEDUpdate >= OLED_UPDATE_INTERVAL) {
             lastOLEDUpdate = currentMillis;
             checkAndUpdateWiFiStatus();
         }
 
-        // Only run RFID and Google Apps if in STA mode and connected
-        if (!isAPMode && WiFi.status() == WL_CONNECTED) {
+        // Scan tetap diterima saat offline; Google Apps mengecek WiFi sendiri
+        if (!isAPMode) {
             handleRFID();
             handleGoogleApps();
         }
     }
-    
-    server.handleClient();
-    delay(100);
+
+    // Tidak ada yang butuh latensi rendah di sini lagi: tidur sampai task RFID
+    // mengirim scan atau timeout, agar task upload & display (prioritas sama
+    // di core 1) dapat CPU dan journalMutex tidak terus diperebutkan.
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LOOP_IDLE_WAIT_MS));
 }
@@ -0,0 +1,119 @@
+# Gzip isi folder web/ dan tanam ke firmware sebagai array PROGMEM.
+#
+# Hasilnya web_assets.h di $BUILD_DIR/generated (tidak di-commit). Setiap
+# asset punya ETag dari hash isi gzip. Referensi {{nama}} di HTML diganti
+# URL ber-versi (/style.css?v=<hash>) sehingga CSS boleh di-cache selamanya,
+# sedangkan HTML selalu divalidasi ulang lewat ETag.
+
+Import("env")
+
+import gzip
+import hashlib
+import os
+import re
+
+PROJECT_DIR = env.subst("$PROJECT_DIR")
+WEB_DIR = os.path.join(PROJECT_DIR, "web")
+OUT_DIR = os.path.join(env.subst("$BUILD_DIR"), "generated")
+OUT_FILE = os.path.join(OUT_DIR, "web_assets.h")
+
+CONTENT_TYPES = {
+    ".html": "text/html",
+    ".css": "text/css",
+    ".js": "application/javascript",
+}
+
+
+def route_for(name):
+    # index.html -> "/", scan.html -> "/scan", style.css -> "/style.css"
+    base, ext = os.path.splitext(name)
+    if ext != ".html":
+        return "/" + name
+    return "/" if base == "index" else "/" + base
+
+
+def symbol_for(name):
+    return "WEB_ASSET_" + re.sub(r"[^A-Za-z0-9]", "_", name).upper()
+
+
+def compress(data):
+    # mtime=0 agar hasil gzip (dan ETag) sama untuk isi yang sama
+    return gzip.compress(data, compresslevel=9, mtime=0)
+
+
+def build_assets():
+    names = sorted(n for n in os.listdir(WEB_DIR) if os.path.splitext(n)[1] in CONTENT_TYPES)
+    versions = {}
+    assets = []
+
+    # Asset non-HTML dulu: hash-nya dipakai sebagai versi di URL halaman
+    for name in sorted(names, key=lambda n: n.endswith(".html")):
+        with open(os.path.join(WEB_DIR, name), "rb") as f:
+            data = f.read()
+        versioned = not name.endswith(".html")
+        if not versioned:
+            text = data.decode("utf-8")
+            for ref, version in versions.items():
+                text = text.replace("{{%s}}" % ref, "%s?v=%s" % (route_for(ref), version))
+            unresolved = re.findall(r"\{\{[^}]+\}\}", text)
+            if unresolved:
+                raise Exception("%s: referensi asset tidak dikenal %s" % (name, ", ".join(unresolved)))
+            data = text.encode("utf-8")
+
+        gz = compress(data)
+        digest = hashlib.sha1(gz).hexdigest()[:16]
+        if versioned:
+            versions[name] = digest
+        assets.append((name, gz, digest, versioned, len(data)))
+
+    return sorted(assets)
+
+
+def write_header(assets):
+    lines = [
+        "// Dihasilkan tools/embed_web_assets.py dari folder web/, jangan diedit.",
+        "#pragma once",
+        "#include <Arduino.h>",
+        "",
+        "struct WebAsset",
+        "{",
+        "    const char *path;        // Route HTTP",
+        "    const char *contentType;",
+        "    const char *etag;        // Hash isi gzip, termasuk tanda kutip",
+        "    bool versioned;          // Dirujuk dengan ?v=<hash>, boleh di-cache selamanya",
+        "    const uint8_t *data;     // Isi gzip di flash",
+        "    size_t length;",
+        "};",
+        "",
+    ]
+    for name, gz, digest, versioned, raw_length in assets:
+        lines.append("// %s: %d -> %d byte" % (name, raw_length, len(gz)))
+        lines.append("static const uint8_t %s[] PROGMEM = {" % symbol_for(name))
+        for i in range(0, len(gz), 16):
+            lines.append("    " + ", ".join("0x%02x" % b for b in gz[i:i + 16]) + ",")
+        lines.append("};")
+        lines.append("")
+
+    lines.append("static const WebAsset WEB_ASSETS[] = {")
+    for name, gz, digest, versioned, raw_length in assets:
+        content_type = CONTENT_TYPES[os.path.splitext(name)[1]]
+        lines.append('    {"%s", "%s", "\\"%s\\"", %s, %s, sizeof(%s)},' % (
+            route_for(name), content_type, digest, "true" if versioned else "false",
+            symbol_for(name), symbol_for(name)))
+    lines.append("};")
+    lines.append("static const size_t WEB_ASSET_COUNT = sizeof(WEB_ASSETS) / sizeof(WEB_ASSETS[0]);")
+    lines.append("")
+    content = "\n".join(lines)
+
+    # Tulis hanya bila berubah agar main.cpp tidak dikompilasi ulang tiap build
+    if os.path.exists(OUT_FILE):
+        with open(OUT_FILE) as f:
+            if f.read() == content:
+                return
+    with open(OUT_FILE, "w") as f:
+        f.write(content)
+
+
+os.makedirs(OUT_DIR, exist_ok=True)
+write_header(build_assets())
+env.Append(CPPPATH=[OUT_DIR])